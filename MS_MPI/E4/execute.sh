@@ -9,8 +9,8 @@ fi
 # Get the filename without the extension
 filename=$(basename "$1" .c)
 
-# Compile the MPI program
-mpicc -o "$filename" "$1"
+# Compile the MPI program; extra flags come from CFLAGS, e.g. CFLAGS=-DHEAT_FLOAT
+mpicc -O3 -fopenmp $CFLAGS -o "$filename" "$1"
 if [ $? -ne 0 ]; then
     echo "Compilation failed"
     exit 1
@@ -1,73 +1,278 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <mpi.h>
+#include "../phase_timer.h"
+#include "../precision.h"
+#include "../grid_util.h"
 
-void swap(double** a, double** b) {
-    double* temp = *a;
-    *a = *b;
-    *b = temp;
+// Start exchanging the `halo` outermost owned cells with both neighbors. The local arrays hold
+// the owned cells at [halo, halo + block_size) and a ghost region of `halo` cells on each side.
+// All transfers are non-blocking, so no process waits for another one to reach its receive and
+// the exchange does not rely on eager buffering. Returns the number of messages sent.
+int exchange_start(real_t* T, int block_size, int halo, int rank, int num_procs, MPI_Request* requests) {
+    int left = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    int right = rank < num_procs - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    MPI_Irecv(&T[0], halo, MPI_REAL_T, left, 1, MPI_COMM_WORLD, &requests[0]);
+    MPI_Irecv(&T[halo + block_size], halo, MPI_REAL_T, right, 0, MPI_COMM_WORLD, &requests[1]);
+    MPI_Isend(&T[halo], halo, MPI_REAL_T, left, 0, MPI_COMM_WORLD, &requests[2]);
+    MPI_Isend(&T[block_size], halo, MPI_REAL_T, right, 1, MPI_COMM_WORLD, &requests[3]);
+
+    return (left != MPI_PROC_NULL) + (right != MPI_PROC_NULL);
+}
+
+// Complete the exchange and mirror the owned cells into the ghost region at the ends of the
+// global grid, so that no heat flows across them. The mirrored cells stay consistent when they
+// are updated redundantly.
+void exchange_finish(real_t* T, int block_size, int halo, int rank, int num_procs, MPI_Request* requests) {
+    MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+    for (int j = 0; j < halo; j++) {
+        if (rank == 0)
+            T[halo - 1 - j] = T[halo + j];
+        if (rank == num_procs - 1)
+            T[halo + block_size + j] = T[halo + block_size - 1 - j];
+    }
+}
+
+// Update n cells starting at c; c[-1] and c[n] must be readable. The ghost region takes the
+// place of the boundary branches, so the loop is branch-free and vectorizes. The sum is
+// evaluated in acc_t (see precision.h).
+SIMD_CLONES
+void stencil_simd(const real_t* restrict c, real_t* restrict out, int n, acc_t conductivity, acc_t delta_t) {
+    for (int i = 0; i < n; i++) {
+        acc_t dTdt_i = conductivity * (-2 * (acc_t)c[i] + c[i - 1] + c[i + 1]);
+        out[i] = (real_t)(c[i] + delta_t * dTdt_i);
+    }
+}
+
+// Scalar reference kernel with the same interface
+void stencil_scalar(const real_t* c, real_t* out, int n, acc_t conductivity, acc_t delta_t) {
+    for (int i = 0; i < n; i++) {
+        int i_left = i - 1;
+        int i_right = i + 1;
+        acc_t dTdt_i = conductivity * (-2 * (acc_t)c[i] + c[i_left] + c[i_right]);
+        out[i] = (real_t)(c[i] + delta_t * dTdt_i);
+    }
+}
+
+void (*stencil)(const real_t*, real_t*, int, acc_t, acc_t) = stencil_simd;
+
+// Contiguous share [*c0, *c1) of the range [i0, i1) for the calling thread
+void thread_chunk(int i0, int i1, int* c0, int* c1) {
+    int t = omp_get_thread_num();
+    int num_threads = omp_get_num_threads();
+    long n = i1 - i0;
+    *c0 = i0 + (int)(n * t / num_threads);
+    *c1 = i0 + (int)(n * (t + 1) / num_threads);
+}
+
+// Update the cells in [i0, i1), split into one contiguous chunk per thread
+void compute_range(const real_t* T_k, real_t* T_kn, int i0, int i1, double conductivity, double delta_t) {
+    if (i1 <= i0) return;
+    #pragma omp parallel if (i1 - i0 >= 4096)
+    {
+        int c0, c1;
+        thread_chunk(i0, i1, &c0, &c1);
+        if (c1 > c0)
+            stencil(T_k + c0, T_kn + c0, c1 - c0, conductivity, delta_t);
+    }
+}
+
+// Allocate n doubles which are first touched by the threads with the chunking of compute_range,
+// so the pages are placed on the NUMA node of the thread updating them
+real_t* alloc_first_touch(int n) {
+    real_t* T = (real_t*) malloc(sizeof(real_t) * n);
+    #pragma omp parallel
+    {
+        int c0, c1;
+        thread_chunk(0, n, &c0, &c1);
+        if (c1 > c0)
+            memset(T + c0, 0, sizeof(real_t) * (c1 - c0));
+    }
+    return T;
+}
+
+// Largest change of an owned cell during the last time step
+double local_residual(const real_t* T_new, const real_t* T_old, int i0, int i1) {
+    double residual = 0.0;
+    #pragma omp parallel for schedule(static) reduction(max:residual)
+    for (int i = i0; i < i1; i++) {
+        double d = fabs(T_new[i] - T_old[i]);
+        if (d > residual) residual = d;
+    }
+    return residual;
 }
 
 int main(int argc, char** args) {
-    MPI_Init(&argc, &args);
-    
+    // Only the master thread calls MPI, the thread team works on the stencil in between
+    int provided;
+    MPI_Init_thread(&argc, &args, MPI_THREAD_FUNNELED, &provided);
+    phase_timer timer;
+    phase_timer_init(&timer, 1);
+    phase_begin(&timer, PHASE_INIT);
+
     int num_procs, rank;
     MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    
+
     double delta_t = 0.02;
     int grid_size = 4*8*8;
-    int block_size = grid_size / num_procs;
     int num_time_steps = 10;
     double conductivity = 0.1;
-    
-    double* T_k = (double*) malloc(sizeof(double) * grid_size);
-    double* T_kn = (double*) malloc(sizeof(double) * grid_size);
-    
-    int start = block_size * rank;
-    int end = block_size * (rank + 1);
-    
-    for (int i = start; i < end; i++) {
-        T_k[i] = i;
+
+    // Command line options:
+    //   --halo H   halo width; the halos are exchanged once every H time steps and the
+    //              overlap region is recomputed redundantly in between
+    //   --n N      global grid size
+    //   --steps N  number of time steps
+    //   --scalar   use the scalar stencil kernel instead of the vectorized one
+    //   --threads N  threads per process (default: OMP_NUM_THREADS)
+    //   --tol EPS  iterate until the residual drops below EPS (--steps is the maximum)
+    //   --check-every K  steps between the non-blocking residual checks
+    //   --timing FILE  write the per-phase timing report to FILE (JSON for *.json, else CSV,
+    //                  - for stdout)
+    int halo = 1;
+    double tolerance = 0.0;
+    int check_every = 10;
+    const char* timing_path = NULL;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(args[a], "--halo") == 0 && a + 1 < argc) halo = atoi(args[++a]);
+        else if (strcmp(args[a], "--n") == 0 && a + 1 < argc) grid_size = atoi(args[++a]);
+        else if (strcmp(args[a], "--steps") == 0 && a + 1 < argc) num_time_steps = atoi(args[++a]);
+        else if (strcmp(args[a], "--scalar") == 0) stencil = stencil_scalar;
+        else if (strcmp(args[a], "--threads") == 0 && a + 1 < argc) omp_set_num_threads(atoi(args[++a]));
+        else if (strcmp(args[a], "--tol") == 0 && a + 1 < argc) tolerance = atof(args[++a]);
+        else if (strcmp(args[a], "--check-every") == 0 && a + 1 < argc) check_every = atoi(args[++a]);
+        else if (strcmp(args[a], "--timing") == 0 && a + 1 < argc) timing_path = args[++a];
     }
+    if (check_every < 1) check_every = 1;
+    timer.enabled = timing_path != NULL;
 
-    for (int k = 0; k < num_time_steps; k++) {
-        if (num_procs > 1) {
-            if (rank > 0) {
-                MPI_Send(&T_k[start], 1, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD);
-                MPI_Recv(&T_k[start - 1], 1, MPI_DOUBLE, rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-            if (rank < num_procs - 1) {
-                MPI_Send(&T_k[end - 1], 1, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD);
-                MPI_Recv(&T_k[end], 1, MPI_DOUBLE, rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-        }
-        
-        for (int i = start; i < end; i++) {
-            int i_left = (i != start) ? i - 1 : start;
-            int i_right = (i != end - 1) ? i + 1 : end - 1;
-            double dTdt_i = conductivity * (-2 * T_k[i] + T_k[i_left] + T_k[i_right]);
-            T_kn[i] = T_k[i] + delta_t * dTdt_i;
+    if (grid_size < num_procs) {
+        if (rank == 0)
+            fprintf(stderr, "The grid of %d cells is too small for %d processes\n", grid_size, num_procs);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // The remainder of the grid is spread over the processes; start is the global index of
+    // the first owned cell
+    int start, block_size;
+    block_range(grid_size, num_procs, rank, &start, &block_size);
+
+    // The halo is taken from the owned cells of a single neighbor, so it may not be wider
+    // than the smallest block
+    int min_block_size = grid_size / num_procs;
+    if (halo < 1) halo = 1;
+    if (halo > min_block_size) {
+        if (rank == 0)
+            printf("Halo width %d exceeds the block size, using %d\n", halo, min_block_size);
+        halo = min_block_size;
+    }
+
+    real_t* T_k = alloc_first_touch(block_size + 2 * halo);
+    real_t* T_kn = alloc_first_touch(block_size + 2 * halo);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < block_size; i++) {
+        T_k[halo + i] = start + i;
+    }
+
+    // In steady-state mode the global residual is reduced with MPI_Iallreduce every check_every
+    // steps and evaluated at the following check, so the reduction overlaps with the sweeps
+    // in between instead of synchronizing all processes every step
+    MPI_Request residual_request = MPI_REQUEST_NULL;
+    double residual_local = 0.0, residual_global = 0.0;
+    int converged = 0;
+
+    int messages = 0;
+    MPI_Request requests[4];
+    phase_end(&timer, PHASE_INIT);
+    int k;
+    for (k = 0; k < num_time_steps; k++) {
+        // Steps since the last exchange; the valid region shrinks by one cell per step
+        int s = k % halo;
+        int i0 = s + 1;
+        int i1 = 2 * halo + block_size - s - 1;
+        if (s == 0) {
+            // Update the owned cells which do not touch the ghost region while the halos are in flight
+            phase_begin(&timer, PHASE_EXCHANGE_POST);
+            messages += exchange_start(T_k, block_size, halo, rank, num_procs, requests);
+            phase_end(&timer, PHASE_EXCHANGE_POST);
+            phase_begin(&timer, PHASE_STENCIL);
+            compute_range(T_k, T_kn, halo + 1, halo + block_size - 1, conductivity, delta_t);
+            phase_end(&timer, PHASE_STENCIL);
+            phase_begin(&timer, PHASE_EXCHANGE_WAIT);
+            exchange_finish(T_k, block_size, halo, rank, num_procs, requests);
+            phase_end(&timer, PHASE_EXCHANGE_WAIT);
+            phase_begin(&timer, PHASE_STENCIL);
+            compute_range(T_k, T_kn, i0, halo + 1, conductivity, delta_t);
+            compute_range(T_k, T_kn, halo + block_size - 1 > halo + 1 ? halo + block_size - 1 : halo + 1,
+                          i1, conductivity, delta_t);
+            phase_end(&timer, PHASE_STENCIL);
+        } else {
+            phase_begin(&timer, PHASE_STENCIL);
+            compute_range(T_k, T_kn, i0, i1, conductivity, delta_t);
+            phase_end(&timer, PHASE_STENCIL);
         }
         swap(&T_k, &T_kn);
+
+        if (tolerance > 0 && (k + 1) % check_every == 0) {
+            phase_begin(&timer, PHASE_REDUCE);
+            if (residual_request != MPI_REQUEST_NULL) {
+                MPI_Wait(&residual_request, MPI_STATUS_IGNORE);
+                if (residual_global < tolerance) {
+                    converged = 1;
+                    phase_end(&timer, PHASE_REDUCE);
+                    phase_step_end(&timer);
+                    k++;
+                    break;
+                }
+            }
+            residual_local = local_residual(T_k, T_kn, halo, halo + block_size);
+            MPI_Iallreduce(&residual_local, &residual_global, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD,
+                           &residual_request);
+            phase_end(&timer, PHASE_REDUCE);
+        }
+        phase_step_end(&timer);
+    }
+    if (residual_request != MPI_REQUEST_NULL) {
+        MPI_Wait(&residual_request, MPI_STATUS_IGNORE);
+        converged = converged || residual_global < tolerance;
     }
 
+    phase_begin(&timer, PHASE_REDUCE);
     double T_average = 0;
-    for (int i = start; i < end; i++) {
+    for (int i = halo; i < halo + block_size; i++) {
         T_average += T_k[i];
     }
 
     double global_T_average = 0;
     MPI_Reduce(&T_average, &global_T_average, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
     global_T_average /= grid_size;
+    phase_end(&timer, PHASE_REDUCE);
+
+    int global_messages = 0;
+    MPI_Reduce(&messages, &global_messages, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
     if (rank == 0) {
+        printf("Threads per process: %d, precision: %s\n", omp_get_max_threads(), PRECISION_NAME);
+        if (provided < MPI_THREAD_FUNNELED)
+            printf("Warning: MPI does not provide MPI_THREAD_FUNNELED\n");
+        if (tolerance > 0)
+            printf("%s after %d steps, residual %e\n", converged ? "Converged" : "Not converged",
+                   k, residual_global);
         printf("T_average: %f\n", global_T_average);
+        if (k > 0)
+            printf("Halo width %d: %.3f messages per step\n", halo, (double)global_messages / k);
     }
 
+    phase_report(&timer, "heat1d", timing_path, MPI_COMM_WORLD);
+
     free(T_k);
     free(T_kn);
-    
+
     MPI_Finalize();
     return 0;
 }
@@ -4,25 +4,45 @@
 #include <string.h>
 #include <math.h>  
 #include <stdbool.h>
+#include "../reduce_local.h"
 
+void reduce_sequential(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator);
+
+// Reduce count elements of datatype with op to rank 0 along a binary tree (children 2r + 1 and
+// 2r + 2 of rank r). The tree combines the partial results out of rank order, so
+// non-commutative ops are handed to reduce_sequential.
 void reduce_tree(
-    int* send_data,
-    int* recv_data,
+    const void* send_data,
+    void* recv_data,
     int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
     MPI_Comm communicator)
 {
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
     int my_rank;
     int com_size;
     MPI_Comm_rank(communicator, &my_rank);
     MPI_Comm_size(communicator, &com_size);
 
-    int* my_partial_sum;
+    void* my_partial_sum;
     if (my_rank == 0)
         my_partial_sum = recv_data;
     else
-        my_partial_sum = (int*)malloc(count * sizeof(int));
+        my_partial_sum = buffer_alloc(count, datatype);
 
-    memcpy(my_partial_sum, send_data, count * sizeof(int));
+    buffer_copy(send_data, my_partial_sum, count, datatype);
     
     int my_parent_rank = (my_rank - 1) / 2;
     int left_child_rank = 2 * my_rank + 1;
@@ -32,51 +52,215 @@ void reduce_tree(
     bool right_child_exists = right_child_rank < com_size;
 
 
-    int* left_child_recv_buffer = NULL;
+    void* left_child_recv_buffer = NULL;
     MPI_Request left_child_request = MPI_REQUEST_NULL;
     if (left_child_exists)
     {
-        left_child_recv_buffer = (int*)malloc(count* sizeof(int));
-        MPI_Irecv(left_child_recv_buffer, count, MPI_INT, 
+        left_child_recv_buffer = buffer_alloc(count, datatype);
+        MPI_Irecv(left_child_recv_buffer, count, datatype, 
             left_child_rank, 0, communicator, &left_child_request);
     }
 
-    int* right_child_recv_buffer = NULL;
+    void* right_child_recv_buffer = NULL;
     MPI_Request right_child_request = MPI_REQUEST_NULL;
     if (right_child_exists)
     {
-        right_child_recv_buffer = (int*)malloc(count * sizeof(int));
-        MPI_Irecv(right_child_recv_buffer, count, MPI_INT,
+        right_child_recv_buffer = buffer_alloc(count, datatype);
+        MPI_Irecv(right_child_recv_buffer, count, datatype,
             right_child_rank, 0, communicator, &right_child_request);
     }
 
     if (left_child_exists)
     {
         MPI_Wait(&left_child_request, MPI_STATUS_IGNORE);
-        for (int i = 0; i < count; i++)
-            my_partial_sum[i] += left_child_recv_buffer[i];
-        free(left_child_recv_buffer);
+        reduce_local(left_child_recv_buffer, my_partial_sum, count, datatype, op);
+        buffer_free(left_child_recv_buffer, datatype);
     }
 
     if (right_child_exists)
     {
         MPI_Wait(&right_child_request, MPI_STATUS_IGNORE);
-        for (int i = 0; i < count; i++)
-            my_partial_sum[i] += right_child_recv_buffer[i];
-        free(right_child_recv_buffer);
+        reduce_local(right_child_recv_buffer, my_partial_sum, count, datatype, op);
+        buffer_free(right_child_recv_buffer, datatype);
     }
 
     if (my_rank != 0)
     {
-        MPI_Send(my_partial_sum, count, MPI_INT, my_parent_rank, 0, communicator);
-        free(my_partial_sum);
+        MPI_Send(my_partial_sum, count, datatype, my_parent_rank, 0, communicator);
+        buffer_free(my_partial_sum, datatype);
+    }
+}
+
+// Segmented variant of reduce_tree for large vectors. The vector is cut into segments of
+// segment_count elements which are pipelined up the same binary tree: while segment k is added
+// and forwarded to the parent, segment k + 1 is already arriving from the children. Every child
+// has two receive slots, so at most two segments per child are in flight.
+void reduce_tree_segmented(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    int segment_count,
+    MPI_Comm communicator)
+{
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    if (segment_count <= 0 || segment_count > count)
+        segment_count = count > 0 ? count : 1;
+    int num_segments = (count + segment_count - 1) / segment_count;
+
+    void* my_partial_sum;
+    if (my_rank == 0)
+        my_partial_sum = recv_data;
+    else
+        my_partial_sum = buffer_alloc(count, datatype);
+
+    buffer_copy(send_data, my_partial_sum, count, datatype);
+
+    int my_parent_rank = (my_rank - 1) / 2;
+    int child_rank[2] = { 2 * my_rank + 1, 2 * my_rank + 2 };
+    int num_children = 0;
+    for (int c = 0; c < 2; c++)
+        if (child_rank[c] < com_size)
+            num_children = c + 1;
+
+    // Two receive slots per child; slot k % 2 holds segment k
+    void* child_recv_buffer[2][2] = { { NULL, NULL }, { NULL, NULL } };
+    MPI_Request child_request[2][2] = { { MPI_REQUEST_NULL, MPI_REQUEST_NULL },
+                                        { MPI_REQUEST_NULL, MPI_REQUEST_NULL } };
+    for (int c = 0; c < num_children; c++)
+    {
+        for (int slot = 0; slot < 2 && slot < num_segments; slot++)
+        {
+            int offset = slot * segment_count;
+            int length = count - offset < segment_count ? count - offset : segment_count;
+            child_recv_buffer[c][slot] = buffer_alloc(segment_count, datatype);
+            MPI_Irecv(child_recv_buffer[c][slot], length, datatype,
+                child_rank[c], 0, communicator, &child_request[c][slot]);
+        }
+    }
+
+    MPI_Request* parent_requests = NULL;
+    if (my_rank != 0)
+        parent_requests = (MPI_Request*)malloc(num_segments * sizeof(MPI_Request));
+
+    for (int k = 0; k < num_segments; k++)
+    {
+        int offset = k * segment_count;
+        int length = count - offset < segment_count ? count - offset : segment_count;
+        int slot = k % 2;
+        void* my_segment = buffer_at(my_partial_sum, offset, datatype);
+
+        for (int c = 0; c < num_children; c++)
+        {
+            MPI_Wait(&child_request[c][slot], MPI_STATUS_IGNORE);
+            void* segment = child_recv_buffer[c][slot];
+            reduce_local(segment, my_segment, length, datatype, op);
+
+            // Reuse the slot for segment k + 2
+            int next_offset = (k + 2) * segment_count;
+            if (k + 2 < num_segments)
+            {
+                int next_length = count - next_offset < segment_count ? count - next_offset : segment_count;
+                MPI_Irecv(segment, next_length, datatype,
+                    child_rank[c], 0, communicator, &child_request[c][slot]);
+            }
+        }
+
+        // The segment is complete and is not touched again, so it can be forwarded right away
+        if (my_rank != 0)
+            MPI_Isend(my_segment, length, datatype, my_parent_rank, 0,
+                communicator, &parent_requests[k]);
+    }
+
+    for (int c = 0; c < num_children; c++)
+        for (int slot = 0; slot < 2; slot++)
+            buffer_free(child_recv_buffer[c][slot], datatype);
+
+    if (my_rank != 0)
+    {
+        MPI_Waitall(num_segments, parent_requests, MPI_STATUSES_IGNORE);
+        free(parent_requests);
+        buffer_free(my_partial_sum, datatype);
+    }
+}
+
+// Pick the segment size of reduce_tree_segmented for a vector of count elements of datatype
+// with a short probe: the probe vector holds min(count, 4M) elements, and every candidate
+// segment size (powers of two from 1024 elements up to the probe length, and the probe length
+// itself) is timed on the real communicator. The fastest one, as measured at the root, is
+// broadcast to all processes. Only for count <= 4M does the largest candidate mean no
+// segmentation. If probe_length is not NULL, it receives the probe length, so callers can tell
+// whether the probe was truncated.
+int tune_segment_count(int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm communicator,
+    int* probe_length)
+{
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+
+    int probe_count = count < (1 << 22) ? count : (1 << 22);
+    if (probe_length != NULL)
+        *probe_length = probe_count;
+    if (probe_count <= 1024)
+        return count;
+
+    void* probe_send = buffer_alloc(probe_count, datatype);
+    void* probe_recv = my_rank == 0 ? buffer_alloc(probe_count, datatype) : NULL;
+    MPI_Aint true_lb, true_extent;
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    memset((char*)probe_send + true_lb, 0, (probe_count - 1) * type_extent(datatype) + true_extent);
+
+    int best_segment_count = count;
+    double best_time = INFINITY;
+    int num_repetitions = 3;
+    for (int segment_count = 1024; ; segment_count *= 2)
+    {
+        if (segment_count > probe_count)
+            segment_count = probe_count;
+
+        double time = INFINITY;
+        for (int r = 0; r < num_repetitions; r++)
+        {
+            MPI_Barrier(communicator);
+            double start = MPI_Wtime();
+            reduce_tree_segmented(probe_send, probe_recv, probe_count, datatype, op, segment_count,
+                communicator);
+            double elapsed = MPI_Wtime() - start;
+            if (elapsed < time)
+                time = elapsed;
+        }
+        if (my_rank == 0 && time < best_time)
+        {
+            best_time = time;
+            best_segment_count = segment_count;
+        }
+        if (segment_count == probe_count)
+            break;
     }
+
+    MPI_Bcast(&best_segment_count, 1, MPI_INT, 0, communicator);
+    buffer_free(probe_send, datatype);
+    buffer_free(probe_recv, datatype);
+    return best_segment_count;
 }
 
+// Gather all vectors at rank 0 and combine them there in rank order, so any op works
 void reduce_sequential(
-    int* send_data,
-    int* recv_data,
+    const void* send_data,
+    void* recv_data,
     int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
     MPI_Comm communicator)
 {
     int my_rank;
@@ -84,33 +268,1165 @@ void reduce_sequential(
     MPI_Comm_rank(communicator, &my_rank);
     MPI_Comm_size(communicator, &com_size);
 
-    int* gather_buffer = NULL;
+    void* gather_buffer = NULL;
     if (my_rank == 0)
     {
-        gather_buffer = (int*) calloc(count * com_size, sizeof(int));
+        gather_buffer = buffer_alloc(count * com_size, datatype);
     }
 
-    MPI_Gather(send_data, count, MPI_INT, gather_buffer, count, MPI_INT, 0, communicator);
+    MPI_Gather(send_data, count, datatype, gather_buffer, count, datatype, 0, communicator);
 
     if (my_rank == 0)
     {
-        memset(recv_data, 0, count * sizeof(int));
-        for (int p = 0; p < com_size; p++)
+        // recv = x_0 op (x_1 op (... op x_{p-1})); reduce_local computes inout = in op inout
+        buffer_copy(buffer_at(gather_buffer, (MPI_Aint)count * (com_size - 1), datatype), recv_data,
+            count, datatype);
+        for (int p = com_size - 2; p >= 0; p--)
+            reduce_local(buffer_at(gather_buffer, (MPI_Aint)count * p, datatype), recv_data,
+                count, datatype, op);
+        buffer_free(gather_buffer, datatype);
+    }
+}
+
+// Binomial tree towards rank 0: in round k, the ranks with bit k set send their partial result
+// to the rank 2^k below them and drop out. ceil(log2 p) rounds of one full-vector message.
+void reduce_binomial(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    void* my_partial_sum = my_rank == 0 ? recv_data : buffer_alloc(count, datatype);
+    void* child_recv_buffer = buffer_alloc(count, datatype);
+    buffer_copy(send_data, my_partial_sum, count, datatype);
+
+    for (int mask = 1; mask < com_size; mask <<= 1)
+    {
+        if (my_rank & mask)
+        {
+            MPI_Send(my_partial_sum, count, datatype, my_rank - mask, 0, communicator);
+            break;
+        }
+        if (my_rank + mask < com_size)
+        {
+            MPI_Recv(child_recv_buffer, count, datatype, my_rank + mask, 0, communicator,
+                MPI_STATUS_IGNORE);
+            reduce_local(child_recv_buffer, my_partial_sum, count, datatype, op);
+        }
+    }
+
+    buffer_free(child_recv_buffer, datatype);
+    if (my_rank != 0)
+        buffer_free(my_partial_sum, datatype);
+}
+
+// The recursive algorithms work on a power-of-two number of ranks. With p = pof2 + rem, the
+// first 2 * rem ranks are folded in pairs first: every odd rank among them hands its vector to
+// the even rank below and sits out. The remaining ranks are renumbered 0 .. pof2 - 1, so rank 0
+// keeps the number 0. Returns the new number, or -1 for a rank that sits out.
+int fold_to_power_of_two(void* partial, void* scratch, int count, MPI_Datatype datatype, MPI_Op op,
+    int* pof2, MPI_Comm communicator)
+{
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    *pof2 = 1;
+    while (*pof2 * 2 <= com_size)
+        *pof2 *= 2;
+    int rem = com_size - *pof2;
+
+    if (my_rank < 2 * rem)
+    {
+        if (my_rank % 2 == 1)
+        {
+            MPI_Send(partial, count, datatype, my_rank - 1, 0, communicator);
+            return -1;
+        }
+        MPI_Recv(scratch, count, datatype, my_rank + 1, 0, communicator, MPI_STATUS_IGNORE);
+        reduce_local(scratch, partial, count, datatype, op);
+        return my_rank / 2;
+    }
+    return my_rank - rem;
+}
+
+// Rank of the process with the number new_rank after fold_to_power_of_two
+int unfolded_rank(int new_rank, int com_size, int pof2)
+{
+    int rem = com_size - pof2;
+    return new_rank < rem ? 2 * new_rank : new_rank + rem;
+}
+
+// Recursive doubling (butterfly): in round k every rank exchanges its whole partial result
+// with the rank whose number differs in bit k, so after log2(pof2) rounds all ranks that took
+// part hold the result. Leaves the result in `result` on every participating rank and returns
+// the new number of the calling rank (-1 if it sat out).
+int recursive_doubling(const void* send_data, void* result, int count, MPI_Datatype datatype,
+    MPI_Op op, MPI_Comm communicator)
+{
+    int com_size;
+    MPI_Comm_size(communicator, &com_size);
+
+    void* scratch = buffer_alloc(count, datatype);
+    buffer_copy(send_data, result, count, datatype);
+    int pof2;
+    int new_rank = fold_to_power_of_two(result, scratch, count, datatype, op, &pof2, communicator);
+
+    if (new_rank >= 0)
+    {
+        for (int mask = 1; mask < pof2; mask <<= 1)
+        {
+            int partner = unfolded_rank(new_rank ^ mask, com_size, pof2);
+            MPI_Sendrecv(result, count, datatype, partner, 1, scratch, count, datatype, partner, 1,
+                communicator, MPI_STATUS_IGNORE);
+            reduce_local(scratch, result, count, datatype, op);
+        }
+    }
+    buffer_free(scratch, datatype);
+    return new_rank;
+}
+
+void reduce_recursive_doubling(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    void* result = my_rank == 0 ? recv_data : buffer_alloc(count, datatype);
+    recursive_doubling(send_data, result, count, datatype, op, communicator);
+    if (my_rank != 0)
+        buffer_free(result, datatype);
+}
+
+// Element offset of block b when count elements are split into num_blocks balanced blocks
+int block_offset(int count, int num_blocks, int b)
+{
+    int base = count / num_blocks;
+    int remainder = count % num_blocks;
+    return b * base + (b < remainder ? b : remainder);
+}
+
+// Reduce-scatter by recursive halving: in round k every rank sends the half of its current
+// block range its partner keeps and combines the half it keeps, so the message size halves
+// every round. Afterwards the rank with number new_rank holds the result for the blocks
+// [*lo, *hi) of the pof2 blocks of the vector.
+void reduce_scatter_halving(void* partial, void* scratch, int count, MPI_Datatype datatype, MPI_Op op,
+    int new_rank, int pof2, int* lo, int* hi, MPI_Comm communicator)
+{
+    int com_size;
+    MPI_Comm_size(communicator, &com_size);
+    *lo = 0;
+    *hi = pof2;
+    for (int mask = 1; mask < pof2; mask <<= 1)
+    {
+        int partner = unfolded_rank(new_rank ^ mask, com_size, pof2);
+        int mid = (*lo + *hi) / 2;
+        int keep_lo = new_rank < (new_rank ^ mask) ? *lo : mid;
+        int keep_hi = new_rank < (new_rank ^ mask) ? mid : *hi;
+        int send_lo = new_rank < (new_rank ^ mask) ? mid : *lo;
+        int send_hi = new_rank < (new_rank ^ mask) ? *hi : mid;
+
+        int send_offset = block_offset(count, pof2, send_lo);
+        int send_count = block_offset(count, pof2, send_hi) - send_offset;
+        int keep_offset = block_offset(count, pof2, keep_lo);
+        int keep_count = block_offset(count, pof2, keep_hi) - keep_offset;
+        MPI_Sendrecv(buffer_at(partial, send_offset, datatype), send_count, datatype, partner, 2,
+            buffer_at(scratch, keep_offset, datatype), keep_count, datatype, partner, 2,
+            communicator, MPI_STATUS_IGNORE);
+        reduce_local(buffer_at(scratch, keep_offset, datatype), buffer_at(partial, keep_offset, datatype),
+            keep_count, datatype, op);
+        *lo = keep_lo;
+        *hi = keep_hi;
+    }
+}
+
+// Rabenseifner's algorithm: reduce-scatter by recursive halving, then a binomial gather of the
+// blocks to rank 0 that retraces the halving steps in reverse. Every rank sends about 2 n bytes
+// in total, independent of p, at the price of 2 log2(p) startups.
+void reduce_rabenseifner(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    // The vector has to split into one non-empty block per rank
+    if (!op_is_commutative(op) || count < com_size)
+    {
+        reduce_binomial(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    void* partial = my_rank == 0 ? recv_data : buffer_alloc(count, datatype);
+    void* scratch = buffer_alloc(count, datatype);
+    buffer_copy(send_data, partial, count, datatype);
+    int pof2;
+    int new_rank = fold_to_power_of_two(partial, scratch, count, datatype, op, &pof2, communicator);
+
+    if (new_rank >= 0)
+    {
+        int lo, hi;
+        reduce_scatter_halving(partial, scratch, count, datatype, op, new_rank, pof2, &lo, &hi, communicator);
+
+        // In reverse order, the partner that kept the upper half hands it back to the lower one
+        for (int mask = pof2 / 2; mask >= 1; mask >>= 1)
+        {
+            if (new_rank >= 2 * mask)
+                continue;
+            int offset = block_offset(count, pof2, lo);
+            int length = block_offset(count, pof2, hi) - offset;
+            if (new_rank >= mask)
+            {
+                MPI_Send(buffer_at(partial, offset, datatype), length, datatype,
+                    unfolded_rank(new_rank - mask, com_size, pof2), 3, communicator);
+                break;
+            }
+            int upper_offset = block_offset(count, pof2, hi);
+            int upper_length = block_offset(count, pof2, 2 * hi - lo) - upper_offset;
+            MPI_Recv(buffer_at(partial, upper_offset, datatype), upper_length, datatype,
+                unfolded_rank(new_rank + mask, com_size, pof2), 3, communicator, MPI_STATUS_IGNORE);
+            hi = 2 * hi - lo;
+        }
+    }
+
+    buffer_free(scratch, datatype);
+    if (my_rank != 0)
+        buffer_free(partial, datatype);
+}
+
+// Pipelined chain p - 1 -> p - 2 -> ... -> 0: every rank receives segment k from its upper
+// neighbor, combines it with its own and forwards it down while segment k + 1 is arriving.
+// With m segments it takes p - 2 + m segment steps, so for large vectors the time approaches
+// n / BW regardless of p.
+void reduce_chain(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    int segment_count,
+    MPI_Comm communicator)
+{
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    if (segment_count <= 0 || segment_count > count)
+        segment_count = count > 0 ? count : 1;
+    int num_segments = (count + segment_count - 1) / segment_count;
+    int upper = my_rank + 1 < com_size ? my_rank + 1 : MPI_PROC_NULL;
+    int lower = my_rank > 0 ? my_rank - 1 : MPI_PROC_NULL;
+
+    void* partial = my_rank == 0 ? recv_data : buffer_alloc(count, datatype);
+    buffer_copy(send_data, partial, count, datatype);
+
+    void* slot_buffer[2] = { buffer_alloc(segment_count, datatype), buffer_alloc(segment_count, datatype) };
+    MPI_Request slot_request[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    MPI_Request* lower_requests = (MPI_Request*)malloc(num_segments * sizeof(MPI_Request));
+    for (int k = 0; k < 2 && k < num_segments && upper != MPI_PROC_NULL; k++)
+    {
+        int length = count - k * segment_count < segment_count ? count - k * segment_count : segment_count;
+        MPI_Irecv(slot_buffer[k], length, datatype, upper, 4, communicator, &slot_request[k]);
+    }
+
+    for (int k = 0; k < num_segments; k++)
+    {
+        int offset = k * segment_count;
+        int length = count - offset < segment_count ? count - offset : segment_count;
+        void* my_segment = buffer_at(partial, offset, datatype);
+        if (upper != MPI_PROC_NULL)
+        {
+            MPI_Wait(&slot_request[k % 2], MPI_STATUS_IGNORE);
+            reduce_local(slot_buffer[k % 2], my_segment, length, datatype, op);
+            if (k + 2 < num_segments)
+            {
+                int next_offset = (k + 2) * segment_count;
+                int next_length = count - next_offset < segment_count ? count - next_offset : segment_count;
+                MPI_Irecv(slot_buffer[k % 2], next_length, datatype, upper, 4, communicator, &slot_request[k % 2]);
+            }
+        }
+        lower_requests[k] = MPI_REQUEST_NULL;
+        if (lower != MPI_PROC_NULL)
+            MPI_Isend(my_segment, length, datatype, lower, 4, communicator, &lower_requests[k]);
+    }
+
+    MPI_Waitall(num_segments, lower_requests, MPI_STATUSES_IGNORE);
+    free(lower_requests);
+    buffer_free(slot_buffer[0], datatype);
+    buffer_free(slot_buffer[1], datatype);
+    if (my_rank != 0)
+        buffer_free(partial, datatype);
+}
+
+// Reduction engine: the algorithms above behind one call, picked per call from a
+// latency/bandwidth cost model (see the performance estimation at the end of the file).
+enum
+{
+    REDUCE_AUTO = -1,
+    REDUCE_LINEAR,
+    REDUCE_BINARY_TREE,
+    REDUCE_BINOMIAL,
+    REDUCE_RECURSIVE_DOUBLING,
+    REDUCE_RABENSEIFNER,
+    REDUCE_CHAIN,
+    NUM_REDUCE_ALGORITHMS
+};
+
+const char* reduce_algorithm_names[NUM_REDUCE_ALGORITHMS] = {
+    "linear", "binary_tree", "binomial", "recursive_doubling", "rabenseifner", "chain"
+};
+
+#define REDUCE_MAX_GAMMAS 16
+
+// alpha: startup time of a message, beta: transfer time per byte,
+// gamma: time per byte of a local reduction of doubles with MPI_SUM, the vectorized fast path.
+// The local reduction of other datatypes and ops, user-defined ops in particular, can cost many
+// times more; their gamma is measured on first use and kept in gammas.
+typedef struct
+{
+    double alpha;
+    double beta;
+    double gamma;
+    int num_gammas;
+    struct
+    {
+        MPI_Datatype datatype;
+        MPI_Op op;
+        double gamma;
+    } gammas[REDUCE_MAX_GAMMAS];
+} reduce_cost_model;
+
+// Time per byte of reduce_local on about 1 MiB of datatype with op
+double measure_local_reduction(MPI_Datatype datatype, MPI_Op op, int repetitions)
+{
+    int size;
+    MPI_Type_size(datatype, &size);
+    int count = size > 0 && (1 << 20) / size > 0 ? (1 << 20) / size : 1;
+    void* in = buffer_alloc(count, datatype);
+    void* inout = buffer_alloc(count, datatype);
+    MPI_Aint true_lb, true_extent;
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    MPI_Aint span = (count - 1) * type_extent(datatype) + true_extent;
+    memset((char*)in + true_lb, 0, span);
+    memset((char*)inout + true_lb, 0, span);
+
+    double start = MPI_Wtime();
+    for (int r = 0; r < repetitions; r++)
+        reduce_local(in, inout, count, datatype, op);
+    double time = (MPI_Wtime() - start) / repetitions;
+    buffer_free(in, datatype);
+    buffer_free(inout, datatype);
+    return time / ((double)count * (size > 0 ? size : 1));
+}
+
+// Measure the model parameters with a ping-pong and a local reduction, collectively. To be
+// topology-aware, the ping-pong runs between rank 0 and the first rank on another node if the
+// communicator spans several nodes, since the slowest link bounds every algorithm. Rank 0's
+// measurement is broadcast, so all ranks select the same algorithm.
+void reduce_model_measure(reduce_cost_model* model, MPI_Comm communicator)
+{
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    // Ranks sharing memory with rank 0 report 1
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(communicator, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    int on_root_node = 0;
+    int root_node_id = my_rank == 0 ? 1 : 0;
+    MPI_Bcast(&root_node_id, 1, MPI_INT, 0, node_comm);
+    on_root_node = root_node_id;
+    MPI_Comm_free(&node_comm);
+    int* on_root_node_all = (int*)malloc(com_size * sizeof(int));
+    MPI_Allgather(&on_root_node, 1, MPI_INT, on_root_node_all, 1, MPI_INT, communicator);
+    int partner = com_size > 1 ? 1 : 0;
+    for (int r = 1; r < com_size; r++)
+    {
+        if (!on_root_node_all[r])
+        {
+            partner = r;
+            break;
+        }
+    }
+    free(on_root_node_all);
+
+    const int large = 1 << 20;
+    const int repetitions = 20;
+    char* message = (char*)calloc(large, 1);
+    double times[2] = { 0.0, 0.0 };
+    int lengths[2] = { 0, large };
+    for (int l = 0; l < 2 && partner != 0; l++)
+    {
+        MPI_Barrier(communicator);
+        double start = MPI_Wtime();
+        for (int r = 0; r < repetitions; r++)
+        {
+            if (my_rank == 0)
+            {
+                MPI_Send(message, lengths[l], MPI_BYTE, partner, 5, communicator);
+                MPI_Recv(message, lengths[l], MPI_BYTE, partner, 5, communicator, MPI_STATUS_IGNORE);
+            }
+            else if (my_rank == partner)
+            {
+                MPI_Recv(message, lengths[l], MPI_BYTE, 0, 5, communicator, MPI_STATUS_IGNORE);
+                MPI_Send(message, lengths[l], MPI_BYTE, 0, 5, communicator);
+            }
+        }
+        times[l] = (MPI_Wtime() - start) / (2.0 * repetitions);
+    }
+
+    double parameters[3] = {
+        times[0] > 0.0 ? times[0] : 1e-6,
+        times[1] > times[0] ? (times[1] - times[0]) / large : 1e-10,
+        measure_local_reduction(MPI_DOUBLE, MPI_SUM, repetitions)
+    };
+    MPI_Bcast(parameters, 3, MPI_DOUBLE, 0, communicator);
+    model->alpha = parameters[0];
+    model->beta = parameters[1];
+    model->gamma = parameters[2];
+    model->num_gammas = 1;
+    model->gammas[0].datatype = MPI_DOUBLE;
+    model->gammas[0].op = MPI_SUM;
+    model->gammas[0].gamma = model->gamma;
+    free(message);
+}
+
+// gamma of the local reduction of datatype with op, measured at rank 0 on first use and
+// broadcast, so all ranks select the same algorithm. Collective, like the reductions. Entries
+// are keyed by handle: measure a new model after freeing user-defined ops or datatypes.
+double reduce_model_gamma(reduce_cost_model* model, MPI_Datatype datatype, MPI_Op op,
+    MPI_Comm communicator)
+{
+    for (int g = 0; g < model->num_gammas; g++)
+        if (model->gammas[g].datatype == datatype && model->gammas[g].op == op)
+            return model->gammas[g].gamma;
+
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    double gamma = my_rank == 0 ? measure_local_reduction(datatype, op, 5) : 0.0;
+    MPI_Bcast(&gamma, 1, MPI_DOUBLE, 0, communicator);
+
+    // A full table keeps the first entries and replaces the last one
+    int g = model->num_gammas < REDUCE_MAX_GAMMAS ? model->num_gammas++ : REDUCE_MAX_GAMMAS - 1;
+    model->gammas[g].datatype = datatype;
+    model->gammas[g].op = op;
+    model->gammas[g].gamma = gamma;
+    return gamma;
+}
+
+// Number of segments of the pipelined chain minimizing (p - 2 + m) (alpha + n (beta + gamma) / m).
+// With two ranks there is no pipeline to fill, the cost m alpha + n (beta + gamma) grows with m.
+int chain_segments(const reduce_cost_model* model, double bytes, int p)
+{
+    if (p <= 2)
+        return 1;
+    double m = sqrt((p - 2) * bytes * (model->beta + model->gamma) / model->alpha);
+    return m < 1.0 ? 1 : (int)m;
+}
+
+// Predicted time of an algorithm for n bytes on p ranks
+double reduce_cost(const reduce_cost_model* model, int algorithm, double n, int p)
+{
+    double alpha = model->alpha, beta = model->beta, gamma = model->gamma;
+    if (p <= 1)
+        return 0.0;
+    double log_p = ceil(log2(p));
+    int pof2 = 1;
+    while (pof2 * 2 <= p)
+        pof2 *= 2;
+    double fold = pof2 < p ? alpha + n * (beta + gamma) : 0.0;
+    double log_pof2 = log2(pof2);
+    switch (algorithm)
+    {
+    case REDUCE_LINEAR:
+        // All vectors cross the link of the root, then p - 1 local reductions
+        return log_p * alpha + (p - 1) * n * (beta + gamma);
+    case REDUCE_BINARY_TREE:
+        // Each level: two children share the link of their parent
+        return (ceil(log2(p + 1)) - 1) * (alpha + 2 * n * (beta + gamma));
+    case REDUCE_BINOMIAL:
+        return log_p * (alpha + n * (beta + gamma));
+    case REDUCE_RECURSIVE_DOUBLING:
+        return fold + log_pof2 * (alpha + n * (beta + gamma));
+    case REDUCE_RABENSEIFNER:
+        return fold + 2 * log_pof2 * alpha + 2.0 * (pof2 - 1) / pof2 * n * beta
+            + (double)(pof2 - 1) / pof2 * n * gamma;
+    case REDUCE_CHAIN:
+    {
+        int m = chain_segments(model, n, p);
+        return (p - 2 + m) * (alpha + n / m * (beta + gamma));
+    }
+    }
+    return INFINITY;
+}
+
+// Cheapest applicable algorithm for count elements of datatype, with the gamma of datatype and
+// op. Non-commutative ops can only be combined in rank order by the linear algorithm;
+// Rabenseifner needs a block per rank.
+int reduce_select(reduce_cost_model* model, int count, MPI_Datatype datatype, MPI_Op op,
+    MPI_Comm communicator)
+{
+    int com_size;
+    MPI_Comm_size(communicator, &com_size);
+    if (!op_is_commutative(op))
+        return REDUCE_LINEAR;
+    int size;
+    MPI_Type_size(datatype, &size);
+    double bytes = (double)count * size;
+    reduce_cost_model op_model = *model;
+    op_model.gamma = reduce_model_gamma(model, datatype, op, communicator);
+
+    int best = REDUCE_BINOMIAL;
+    double best_cost = INFINITY;
+    for (int algorithm = 0; algorithm < NUM_REDUCE_ALGORITHMS; algorithm++)
+    {
+        if (algorithm == REDUCE_RABENSEIFNER && count < com_size)
+            continue;
+        double cost = reduce_cost(&op_model, algorithm, bytes, com_size);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = algorithm;
+        }
+    }
+    return best;
+}
+
+// Reduce to rank 0 with the given algorithm, or the one the model selects for REDUCE_AUTO.
+// Returns the algorithm used.
+int reduce_engine(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    reduce_cost_model* model,
+    int algorithm,
+    MPI_Comm communicator)
+{
+    if (algorithm == REDUCE_AUTO)
+        algorithm = reduce_select(model, count, datatype, op, communicator);
+    switch (algorithm)
+    {
+    case REDUCE_LINEAR:
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        break;
+    case REDUCE_BINARY_TREE:
+        reduce_tree(send_data, recv_data, count, datatype, op, communicator);
+        break;
+    case REDUCE_BINOMIAL:
+        reduce_binomial(send_data, recv_data, count, datatype, op, communicator);
+        break;
+    case REDUCE_RECURSIVE_DOUBLING:
+        reduce_recursive_doubling(send_data, recv_data, count, datatype, op, communicator);
+        break;
+    case REDUCE_RABENSEIFNER:
+        reduce_rabenseifner(send_data, recv_data, count, datatype, op, communicator);
+        break;
+    case REDUCE_CHAIN:
+    {
+        int com_size, size;
+        MPI_Comm_size(communicator, &com_size);
+        MPI_Type_size(datatype, &size);
+        reduce_cost_model op_model = *model;
+        op_model.gamma = reduce_model_gamma(model, datatype, op, communicator);
+        int m = chain_segments(&op_model, (double)count * size, com_size);
+        reduce_chain(send_data, recv_data, count, datatype, op, (count + m - 1) / m, communicator);
+        break;
+    }
+    }
+    return algorithm;
+}
+
+// Broadcast from rank 0 down the binary tree reduce_tree uses: rank i forwards to 2i + 1 and 2i + 2
+void bcast_tree(void* data, int count, MPI_Datatype datatype, MPI_Comm communicator)
+{
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+
+    if (my_rank > 0)
+        MPI_Recv(data, count, datatype, (my_rank - 1) / 2, 6, communicator, MPI_STATUS_IGNORE);
+    MPI_Request child_send_requests[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    for (int c = 0; c < 2; c++)
+    {
+        int child = 2 * my_rank + 1 + c;
+        if (child < com_size)
+            MPI_Isend(data, count, datatype, child, 6, communicator, &child_send_requests[c]);
+    }
+    MPI_Waitall(2, child_send_requests, MPI_STATUSES_IGNORE);
+}
+
+// Allreduce as reduce_tree followed by bcast_tree: 2 (h - 1) levels, the result passes every
+// level twice
+void allreduce_tree(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    reduce_tree(send_data, recv_data, count, datatype, op, communicator);
+    bcast_tree(recv_data, count, datatype, communicator);
+}
+
+// After fold_to_power_of_two, hand the result back to the ranks that sat out
+void unfold_result(void* result, int count, MPI_Datatype datatype, int pof2, MPI_Comm communicator)
+{
+    int my_rank;
+    int com_size;
+    MPI_Comm_rank(communicator, &my_rank);
+    MPI_Comm_size(communicator, &com_size);
+    int rem = com_size - pof2;
+    if (my_rank >= 2 * rem)
+        return;
+    if (my_rank % 2 == 1)
+        MPI_Recv(result, count, datatype, my_rank - 1, 7, communicator, MPI_STATUS_IGNORE);
+    else
+        MPI_Send(result, count, datatype, my_rank + 1, 7, communicator);
+}
+
+// Allreduce by recursive doubling: log2(p) rounds of full-vector exchanges, the best choice for
+// short vectors
+void allreduce_recursive_doubling(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    if (!op_is_commutative(op))
+    {
+        reduce_sequential(send_data, recv_data, count, datatype, op, communicator);
+        bcast_tree(recv_data, count, datatype, communicator);
+        return;
+    }
+
+    int com_size;
+    MPI_Comm_size(communicator, &com_size);
+    int pof2 = 1;
+    while (pof2 * 2 <= com_size)
+        pof2 *= 2;
+    recursive_doubling(send_data, recv_data, count, datatype, op, communicator);
+    unfold_result(recv_data, count, datatype, pof2, communicator);
+}
+
+// Allreduce by recursive halving and doubling (Rabenseifner): reduce-scatter by recursive
+// halving, then an allgather that retraces the halving steps in reverse. Each rank sends about
+// 2 n bytes, the best choice for long vectors.
+void allreduce_recursive_halving(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator)
+{
+    int com_size;
+    MPI_Comm_size(communicator, &com_size);
+    if (!op_is_commutative(op) || count < com_size)
+    {
+        allreduce_recursive_doubling(send_data, recv_data, count, datatype, op, communicator);
+        return;
+    }
+
+    void* scratch = buffer_alloc(count, datatype);
+    buffer_copy(send_data, recv_data, count, datatype);
+    int pof2;
+    int new_rank = fold_to_power_of_two(recv_data, scratch, count, datatype, op, &pof2, communicator);
+
+    if (new_rank >= 0)
+    {
+        int lo, hi;
+        reduce_scatter_halving(recv_data, scratch, count, datatype, op, new_rank, pof2, &lo, &hi,
+            communicator);
+
+        // The partner of each step holds the other half of the range both had before it
+        for (int mask = pof2 / 2; mask >= 1; mask >>= 1)
+        {
+            int partner_new_rank = new_rank ^ mask;
+            int partner_lo = new_rank < partner_new_rank ? hi : 2 * lo - hi;
+            int partner_hi = new_rank < partner_new_rank ? 2 * hi - lo : lo;
+            int offset = block_offset(count, pof2, lo);
+            int length = block_offset(count, pof2, hi) - offset;
+            int partner_offset = block_offset(count, pof2, partner_lo);
+            int partner_length = block_offset(count, pof2, partner_hi) - partner_offset;
+            int partner = unfolded_rank(partner_new_rank, com_size, pof2);
+            MPI_Sendrecv(buffer_at(recv_data, offset, datatype), length, datatype, partner, 8,
+                buffer_at(recv_data, partner_offset, datatype), partner_length, datatype, partner, 8,
+                communicator, MPI_STATUS_IGNORE);
+            lo = lo < partner_lo ? lo : partner_lo;
+            hi = hi > partner_hi ? hi : partner_hi;
+        }
+    }
+    unfold_result(recv_data, count, datatype, pof2, communicator);
+    buffer_free(scratch, datatype);
+}
+
+// For vector lengths 1, 8, 64, ... up to max_count, time the allreduce variants and
+// MPI_Allreduce (best of three) and check that every rank got the result of MPI_Allreduce
+void benchmark_allreduce(int max_count, MPI_Comm communicator)
+{
+    enum { NUM_VARIANTS = 4 };
+    const char* names[NUM_VARIANTS] = { "tree", "recursive_doubling", "recursive_halving", "MPI_Allreduce" };
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    int* send_data = (int*)malloc(max_count * sizeof(int));
+    int* recv_data = (int*)malloc(max_count * sizeof(int));
+    int* expected = (int*)malloc(max_count * sizeof(int));
+    for (int i = 0; i < max_count; i++)
+        send_data[i] = my_rank * 3 + i % 1000;
+
+    if (my_rank == 0)
+    {
+        printf("%10s", "count");
+        for (int v = 0; v < NUM_VARIANTS; v++)
+            printf(" %18s", names[v]);
+        printf("\n");
+    }
+    for (int count = 1; count <= max_count; count *= 8)
+    {
+        MPI_Allreduce(send_data, expected, count, MPI_INT, MPI_SUM, communicator);
+        double best[NUM_VARIANTS];
+        int mismatches = 0;
+        for (int v = 0; v < NUM_VARIANTS; v++)
+        {
+            best[v] = INFINITY;
+            for (int repetition = 0; repetition < 3; repetition++)
+            {
+                MPI_Barrier(communicator);
+                double start = MPI_Wtime();
+                if (v == 0)
+                    allreduce_tree(send_data, recv_data, count, MPI_INT, MPI_SUM, communicator);
+                else if (v == 1)
+                    allreduce_recursive_doubling(send_data, recv_data, count, MPI_INT, MPI_SUM, communicator);
+                else if (v == 2)
+                    allreduce_recursive_halving(send_data, recv_data, count, MPI_INT, MPI_SUM, communicator);
+                else
+                    MPI_Allreduce(send_data, recv_data, count, MPI_INT, MPI_SUM, communicator);
+                double elapsed = MPI_Wtime() - start;
+                MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, communicator);
+                if (elapsed < best[v])
+                    best[v] = elapsed;
+            }
+            for (int i = 0; i < count; i++)
+                if (recv_data[i] != expected[i])
+                    mismatches++;
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &mismatches, 1, MPI_INT, MPI_SUM, communicator);
+        if (my_rank == 0)
+        {
+            printf("%10d", count);
+            for (int v = 0; v < NUM_VARIANTS; v++)
+                printf(" %18.3e", best[v]);
+            if (mismatches > 0)
+                printf("  (%d elements differ from MPI_Allreduce)", mismatches);
+            printf("\n");
+        }
+    }
+    free(send_data);
+    free(recv_data);
+    free(expected);
+}
+
+// Non-blocking reduce_tree. ireduce_tree posts the receives from the children, or on a leaf
+// the send to the parent, and returns a request; ireduce_test advances it through its states
+// without blocking, so a rank can keep computing and call it now and then, e.g. once per time
+// step or loop iteration:
+//   IREDUCE_CHILDREN  combine each child's vector as soon as it has arrived
+//   IREDUCE_PARENT    own partial result is on its way to the parent
+//   IREDUCE_GATHER    non-commutative op: vectors are gathered at rank 0 and combined in rank order
+//   IREDUCE_DONE
+// Like with MPI_Ireduce, all ranks have to start their non-blocking reductions on a communicator
+// in the same order, and send_data must not change before the request completes.
+enum
+{
+    IREDUCE_CHILDREN,
+    IREDUCE_PARENT,
+    IREDUCE_GATHER,
+    IREDUCE_DONE
+};
+
+typedef struct
+{
+    int state;
+    int count;
+    MPI_Datatype datatype;
+    MPI_Op op;
+    MPI_Comm communicator;
+    int my_rank;
+    int com_size;
+    void* recv_data;
+    void* my_partial_sum;
+    void* child_recv_buffer[2];
+    MPI_Request child_request[2];
+    bool child_pending[2];
+    MPI_Request parent_request;
+    void* gather_buffer;
+    MPI_Request gather_request;
+} ireduce_request;
+
+void ireduce_tree(
+    const void* send_data,
+    void* recv_data,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm communicator,
+    ireduce_request** request)
+{
+    ireduce_request* r = (ireduce_request*)calloc(1, sizeof(ireduce_request));
+    r->count = count;
+    r->datatype = datatype;
+    r->op = op;
+    r->communicator = communicator;
+    r->recv_data = recv_data;
+    r->parent_request = MPI_REQUEST_NULL;
+    r->gather_request = MPI_REQUEST_NULL;
+    MPI_Comm_rank(communicator, &r->my_rank);
+    MPI_Comm_size(communicator, &r->com_size);
+    *request = r;
+
+    if (!op_is_commutative(op))
+    {
+        if (r->my_rank == 0)
+            r->gather_buffer = buffer_alloc(count * r->com_size, datatype);
+        MPI_Igather(send_data, count, datatype, r->gather_buffer, count, datatype, 0, communicator,
+            &r->gather_request);
+        r->state = IREDUCE_GATHER;
+        return;
+    }
+
+    // Leaves have nothing to wait for: their vector goes to the parent right away, straight from
+    // send_data, so the first reductions of the tree run during the first compute interval
+    bool leaf = 2 * r->my_rank + 1 >= r->com_size;
+    if (leaf && r->my_rank > 0)
+    {
+        MPI_Isend(send_data, count, datatype, (r->my_rank - 1) / 2, 9, communicator, &r->parent_request);
+        r->state = IREDUCE_PARENT;
+        return;
+    }
+
+    r->my_partial_sum = r->my_rank == 0 ? recv_data : buffer_alloc(count, datatype);
+    buffer_copy(send_data, r->my_partial_sum, count, datatype);
+    for (int c = 0; c < 2; c++)
+    {
+        int child_rank = 2 * r->my_rank + 1 + c;
+        r->child_request[c] = MPI_REQUEST_NULL;
+        r->child_pending[c] = child_rank < r->com_size;
+        if (r->child_pending[c])
+        {
+            r->child_recv_buffer[c] = buffer_alloc(count, datatype);
+            MPI_Irecv(r->child_recv_buffer[c], count, datatype, child_rank, 9, communicator,
+                &r->child_request[c]);
+        }
+    }
+    r->state = IREDUCE_CHILDREN;
+}
+
+// Advance the reduction as far as possible without blocking. Sets *flag once it is complete;
+// the request is then freed and *request set to NULL.
+void ireduce_test(ireduce_request** request, int* flag)
+{
+    ireduce_request* r = *request;
+    int completed;
+    *flag = 0;
+    if (r == NULL)
+    {
+        *flag = 1;
+        return;
+    }
+
+    if (r->state == IREDUCE_GATHER)
+    {
+        MPI_Test(&r->gather_request, &completed, MPI_STATUS_IGNORE);
+        if (!completed)
+            return;
+        if (r->my_rank == 0)
+        {
+            buffer_copy(buffer_at(r->gather_buffer, (MPI_Aint)r->count * (r->com_size - 1), r->datatype),
+                r->recv_data, r->count, r->datatype);
+            for (int p = r->com_size - 2; p >= 0; p--)
+                reduce_local(buffer_at(r->gather_buffer, (MPI_Aint)r->count * p, r->datatype), r->recv_data,
+                    r->count, r->datatype, r->op);
+            buffer_free(r->gather_buffer, r->datatype);
+        }
+        r->state = IREDUCE_DONE;
+    }
+
+    if (r->state == IREDUCE_CHILDREN)
+    {
+        for (int c = 0; c < 2; c++)
+        {
+            if (!r->child_pending[c])
+                continue;
+            MPI_Test(&r->child_request[c], &completed, MPI_STATUS_IGNORE);
+            if (!completed)
+                continue;
+            reduce_local(r->child_recv_buffer[c], r->my_partial_sum, r->count, r->datatype, r->op);
+            buffer_free(r->child_recv_buffer[c], r->datatype);
+            r->child_pending[c] = false;
+        }
+        if (r->child_pending[0] || r->child_pending[1])
+            return;
+        if (r->my_rank == 0)
+        {
+            r->state = IREDUCE_DONE;
+        }
+        else
+        {
+            MPI_Isend(r->my_partial_sum, r->count, r->datatype, (r->my_rank - 1) / 2, 9, r->communicator,
+                &r->parent_request);
+            r->state = IREDUCE_PARENT;
+        }
+    }
+
+    if (r->state == IREDUCE_PARENT)
+    {
+        MPI_Test(&r->parent_request, &completed, MPI_STATUS_IGNORE);
+        if (!completed)
+            return;
+        buffer_free(r->my_partial_sum, r->datatype);
+        r->state = IREDUCE_DONE;
+    }
+
+    free(r);
+    *request = NULL;
+    *flag = 1;
+}
+
+void ireduce_wait(ireduce_request** request)
+{
+    int flag = 0;
+    while (!flag)
+        ireduce_test(request, &flag);
+}
+
+// Stand-in for the computation a reduction can overlap with; returns a value so it is not optimized away
+double compute_work(int iterations)
+{
+    double sum = 0.0;
+    for (int i = 0; i < iterations; i++)
+        sum += sin(i * 1e-3);
+    return sum;
+}
+
+// Reduce count ints with reduce_tree followed by computation, then with ireduce_tree polled
+// from within the same computation, and print both times and whether the results agree
+void benchmark_ireduce(int count, MPI_Comm communicator)
+{
+    const int work_chunks = 64;
+    const int chunk_iterations = 20000;
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    int* send_data = (int*)malloc(count * sizeof(int));
+    int* blocking_result = (int*)malloc(count * sizeof(int));
+    int* nonblocking_result = (int*)malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++)
+        send_data[i] = my_rank + i;
+
+    double work = 0.0;
+    MPI_Barrier(communicator);
+    double start = MPI_Wtime();
+    reduce_tree(send_data, blocking_result, count, MPI_INT, MPI_SUM, communicator);
+    for (int chunk = 0; chunk < work_chunks; chunk++)
+        work += compute_work(chunk_iterations);
+    double time_blocking = MPI_Wtime() - start;
+
+    MPI_Barrier(communicator);
+    start = MPI_Wtime();
+    ireduce_request* request;
+    int done = 0;
+    ireduce_tree(send_data, nonblocking_result, count, MPI_INT, MPI_SUM, communicator, &request);
+    for (int chunk = 0; chunk < work_chunks; chunk++)
+    {
+        work += compute_work(chunk_iterations);
+        if (!done)
+            ireduce_test(&request, &done);
+    }
+    ireduce_wait(&request);
+    double time_nonblocking = MPI_Wtime() - start;
+
+    MPI_Allreduce(MPI_IN_PLACE, &time_blocking, 1, MPI_DOUBLE, MPI_MAX, communicator);
+    MPI_Allreduce(MPI_IN_PLACE, &time_nonblocking, 1, MPI_DOUBLE, MPI_MAX, communicator);
+    if (my_rank == 0)
+    {
+        int mismatches = 0;
+        for (int i = 0; i < count; i++)
+            if (blocking_result[i] != nonblocking_result[i])
+                mismatches++;
+        printf("reduce_tree + work %.3e s, ireduce_tree overlapped with work %.3e s (%d elements differ, "
+            "checksum %.3f)\n", time_blocking, time_nonblocking, mismatches, work);
+    }
+    free(send_data);
+    free(blocking_result);
+    free(nonblocking_result);
+}
+
+// User-defined ops for the self-test: a commutative absolute maximum and the non-commutative
+// "first operand", which reduces to the vector of rank 0 only if the operands stay in rank order
+void op_absmax(void* in, void* inout, int* len, MPI_Datatype* datatype)
+{
+    (void)datatype;
+    const double* a = (const double*)in;
+    double* b = (double*)inout;
+    for (int i = 0; i < *len; i++)
+        b[i] = fabs(a[i]) > fabs(b[i]) ? fabs(a[i]) : fabs(b[i]);
+}
+
+void op_first(void* in, void* inout, int* len, MPI_Datatype* datatype)
+{
+    (void)datatype;
+    memcpy(inout, in, *len * sizeof(int));
+}
+
+// Compare reduce_tree_segmented, ireduce_tree and every algorithm of the reduction engine with
+// MPI_Reduce for one datatype/op pair; returns the number of mismatching elements at the root
+int check_reduction(const void* send_data, int count, MPI_Datatype datatype, MPI_Op op,
+    int segment_count, reduce_cost_model* model, MPI_Comm communicator)
+{
+    enum { NUM_RESULTS = NUM_REDUCE_ALGORITHMS + 3 };
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    int size;
+    MPI_Type_size(datatype, &size);
+    void* result[NUM_RESULTS] = { NULL };
+    if (my_rank == 0)
+        for (int r = 0; r < NUM_RESULTS; r++)
+            result[r] = buffer_alloc(count, datatype);
+
+    for (int algorithm = 0; algorithm < NUM_REDUCE_ALGORITHMS; algorithm++)
+        reduce_engine(send_data, result[algorithm], count, datatype, op, model, algorithm, communicator);
+    reduce_tree_segmented(send_data, result[NUM_RESULTS - 3], count, datatype, op, segment_count,
+        communicator);
+    ireduce_request* request;
+    ireduce_tree(send_data, result[NUM_RESULTS - 2], count, datatype, op, communicator, &request);
+    ireduce_wait(&request);
+    MPI_Reduce(send_data, result[NUM_RESULTS - 1], count, datatype, op, 0, communicator);
+
+    int mismatches = 0;
+    if (my_rank == 0)
+    {
+        for (int r = 0; r < NUM_RESULTS - 1; r++)
             for (int i = 0; i < count; i++)
-                recv_data[i] += gather_buffer[count * p + i];
-        free(gather_buffer);
+                if (memcmp(buffer_at(result[r], i, datatype), buffer_at(result[NUM_RESULTS - 1], i, datatype),
+                        size) != 0)
+                    mismatches++;
+        for (int r = 0; r < NUM_RESULTS; r++)
+            buffer_free(result[r], datatype);
     }
+    return mismatches;
 }
 
+// For vector lengths 1, 8, 64, ... up to max_count, time every algorithm of the engine (best of
+// three) and print it next to the algorithm the cost model selects
+void benchmark_engine(int max_count, reduce_cost_model* model, MPI_Comm communicator)
+{
+    int my_rank;
+    MPI_Comm_rank(communicator, &my_rank);
+    double* send_data = (double*)malloc(max_count * sizeof(double));
+    double* recv_data = (double*)malloc(max_count * sizeof(double));
+    for (int i = 0; i < max_count; i++)
+        send_data[i] = my_rank + i;
 
+    if (my_rank == 0)
+    {
+        printf("%10s %-20s", "count", "selected");
+        for (int algorithm = 0; algorithm < NUM_REDUCE_ALGORITHMS; algorithm++)
+            printf(" %18s", reduce_algorithm_names[algorithm]);
+        printf("\n");
+    }
+    for (int count = 1; count <= max_count; count *= 8)
+    {
+        double best[NUM_REDUCE_ALGORITHMS];
+        for (int algorithm = 0; algorithm < NUM_REDUCE_ALGORITHMS; algorithm++)
+        {
+            best[algorithm] = INFINITY;
+            for (int repetition = 0; repetition < 3; repetition++)
+            {
+                MPI_Barrier(communicator);
+                double start = MPI_Wtime();
+                reduce_engine(send_data, recv_data, count, MPI_DOUBLE, MPI_SUM, model, algorithm, communicator);
+                double elapsed = MPI_Wtime() - start;
+                MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, communicator);
+                if (elapsed < best[algorithm])
+                    best[algorithm] = elapsed;
+            }
+        }
+        int selected = reduce_select(model, count, MPI_DOUBLE, MPI_SUM, communicator);
+        if (my_rank == 0)
+        {
+            printf("%10d %-20s", count, reduce_algorithm_names[selected]);
+            for (int algorithm = 0; algorithm < NUM_REDUCE_ALGORITHMS; algorithm++)
+                printf(" %18.3e", best[algorithm]);
+            printf("\n");
+        }
+    }
+    free(send_data);
+    free(recv_data);
+}
 
 int main(int argc, char** args)
 {
     MPI_Init(&argc, &args);
     int count = 1024;
-    int max_value = 64;
+    int segment_count = 0;
     int* recv_array_tree = NULL;
     int* recv_array_sequential = NULL;
+    int* recv_array_segmented = NULL;
+
+    bool benchmark = false;
+
+    // Command line options: --count N (vector length), --segment N (segment length of the
+    // pipelined tree, 0 tunes it with a probe), --benchmark (time all algorithms of the engine
+    // and the allreduce variants for vector lengths up to N, and the overlap of ireduce_tree)
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(args[a], "--count") == 0 && a + 1 < argc) count = atoi(args[++a]);
+        else if (strcmp(args[a], "--segment") == 0 && a + 1 < argc) segment_count = atoi(args[++a]);
+        else if (strcmp(args[a], "--benchmark") == 0) benchmark = true;
+    }
 
     int my_rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
@@ -118,14 +1434,53 @@ int main(int argc, char** args)
     {
         recv_array_tree = (int*) malloc(count * sizeof(int));
         recv_array_sequential = (int*) malloc(count * sizeof(int));
+        recv_array_segmented = (int*) malloc(count * sizeof(int));
     }
 
     int* send_array = (int*)malloc(count * sizeof(int));
     for (int i = 0; i < count; i++)
         send_array[i] = my_rank;
 
-    reduce_tree(send_array, recv_array_tree, count, MPI_COMM_WORLD);
-    reduce_sequential(send_array, recv_array_sequential, count, MPI_COMM_WORLD);
+    if (segment_count <= 0)
+    {
+        int probe_length;
+        segment_count = tune_segment_count(count, MPI_INT, MPI_SUM, MPI_COMM_WORLD, &probe_length);
+        if (my_rank == 0 && probe_length < count)
+            printf("segment size probed with %d of %d elements, larger segments not tried\n",
+                probe_length, count);
+    }
+
+    reduce_cost_model model;
+    reduce_model_measure(&model, MPI_COMM_WORLD);
+    int selected = reduce_select(&model, count, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    reduce_tree(send_array, recv_array_tree, count, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    double time_tree = MPI_Wtime() - start;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    reduce_tree_segmented(send_array, recv_array_segmented, count, MPI_INT, MPI_SUM, segment_count,
+        MPI_COMM_WORLD);
+    double time_segmented = MPI_Wtime() - start;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    reduce_sequential(send_array, recv_array_sequential, count, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    double time_sequential = MPI_Wtime() - start;
+
+    int* recv_array_engine = my_rank == 0 ? (int*)malloc(count * sizeof(int)) : NULL;
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    reduce_engine(send_array, recv_array_engine, count, MPI_INT, MPI_SUM, &model, REDUCE_AUTO,
+        MPI_COMM_WORLD);
+    double time_engine = MPI_Wtime() - start;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    MPI_Reduce(send_array, recv_array_sequential, count, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    double time_mpi = MPI_Wtime() - start;
 
     if (my_rank == 0)
     {
@@ -133,10 +1488,68 @@ int main(int argc, char** args)
             if (recv_array_tree[i] != recv_array_sequential[i])
                 printf("At index %i: reduce_tree is %i, reduce_sequential is %i\n",
                     i, recv_array_tree[i], recv_array_sequential[i]);
+        for (int i = 0; i < count; i++)
+            if (recv_array_segmented[i] != recv_array_sequential[i])
+                printf("At index %i: reduce_tree_segmented is %i, reduce_sequential is %i\n",
+                    i, recv_array_segmented[i], recv_array_sequential[i]);
+        for (int i = 0; i < count; i++)
+            if (recv_array_engine[i] != recv_array_sequential[i])
+                printf("At index %i: reduce_engine is %i, reduce_sequential is %i\n",
+                    i, recv_array_engine[i], recv_array_sequential[i]);
+
+        printf("count %d: reduce_tree %.3e s, reduce_tree_segmented (segment %d) %.3e s, "
+            "reduce_sequential %.3e s, reduce_engine (%s) %.3e s, MPI_Reduce %.3e s\n", count,
+            time_tree, segment_count, time_segmented, time_sequential,
+            reduce_algorithm_names[selected], time_engine, time_mpi);
+        printf("cost model: alpha %.3e s, beta %.3e s/byte, gamma %.3e s/byte\n",
+            model.alpha, model.beta, model.gamma);
 
         free(recv_array_tree);
         free(recv_array_sequential);
+        free(recv_array_segmented);
+        free(recv_array_engine);
+    }
+
+    // Other datatypes and ops, including user-defined ones, against MPI_Reduce
+    float* send_float = (float*)malloc(count * sizeof(float));
+    double* send_double = (double*)malloc(count * sizeof(double));
+    for (int i = 0; i < count; i++)
+    {
+        send_float[i] = (float)((my_rank * 7 + i * 13) % 101) - 50.0f;
+        send_double[i] = sin(my_rank + 0.1 * i);
+        send_array[i] = my_rank * count + i;
+    }
+    MPI_Op absmax_op, first_op;
+    MPI_Op_create(op_absmax, 1, &absmax_op);
+    MPI_Op_create(op_first, 0, &first_op);
+
+    struct { const char* name; const void* data; MPI_Datatype datatype; MPI_Op op; } checks[] = {
+        { "float max", send_float, MPI_FLOAT, MPI_MAX },
+        { "double min", send_double, MPI_DOUBLE, MPI_MIN },
+        { "int sum", send_array, MPI_INT, MPI_SUM },
+        { "int bxor", send_array, MPI_INT, MPI_BXOR },
+        { "double absmax (user)", send_double, MPI_DOUBLE, absmax_op },
+        { "int first (user, non-commutative)", send_array, MPI_INT, first_op },
+    };
+    for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++)
+    {
+        int mismatches = check_reduction(checks[c].data, count, checks[c].datatype, checks[c].op,
+            segment_count, &model, MPI_COMM_WORLD);
+        if (my_rank == 0 && mismatches > 0)
+            printf("%s: %d elements differ from MPI_Reduce\n", checks[c].name, mismatches);
     }
+
+    if (benchmark)
+    {
+        benchmark_engine(count, &model, MPI_COMM_WORLD);
+        benchmark_allreduce(count, MPI_COMM_WORLD);
+        benchmark_ireduce(count, MPI_COMM_WORLD);
+    }
+
+    MPI_Op_free(&absmax_op);
+    MPI_Op_free(&first_op);
+    free(send_float);
+    free(send_double);
     free(send_array);
     MPI_Finalize();
     return 0;
@@ -196,4 +1609,29 @@ int main(int argc, char** args)
 //      - For larger arrays only consider impact of bandwidth on the runtime:
 //          - reduce_sequential: count * sizeof(int) * (com_size - 1) / BW
 //          - reduce_tree:  2 * count * sizeof(int) * (log_2(com_size + 1) - 1) / BW
-//          -> prefer reduce_tree for larger arrays
\ No newline at end of file
+//          -> prefer reduce_tree for larger arrays
+//
+// Performance estimation for reduce_tree_segmented:
+//      - With m segments, a level can forward segment k while segment k + 1 is arriving, so
+//        the levels work concurrently after the pipeline has filled:
+//              t_total = (h - 1 + m - 1) * (2 * count * sizeof(int) / (m * BW) + t_startup)
+//      - For large arrays the bandwidth term approaches 2 * count * sizeof(int) / BW, which is
+//        independent of the height of the tree; more segments pay more startups, so the best m
+//        grows with the array size. tune_segment_count picks it by measurement.
+//
+// Performance estimation for the algorithms of the reduction engine, with alpha = t_startup,
+// beta = 1 / BW and gamma the time per byte of the local reduction (n bytes, p ranks):
+//      - binomial tree: one message per level, no shared links
+//              t_total = log_2(p) * (alpha + n * (beta + gamma))
+//      - recursive doubling: the same number of rounds, plus one round to fold p down to a
+//        power of two; pays off for allreduce, where every rank needs the result
+//      - Rabenseifner: reduce-scatter by recursive halving and a gather of the blocks
+//              t_total = 2 * log_2(p) * alpha + 2 * (p - 1) / p * n * beta + (p - 1) / p * n * gamma
+//      - pipelined chain with m segments:
+//              t_total = (p - 2 + m) * (alpha + n / m * (beta + gamma))
+//        which is smallest for m = sqrt((p - 2) * n * (beta + gamma) / alpha), and for m = 1
+//        on two ranks
+//      - reduce_cost evaluates these formulas with alpha and beta measured at startup and the
+//        gamma of the datatype and op of the call, measured on its first use, and reduce_select
+//        picks the cheapest algorithm per call: the binomial tree for short vectors, Rabenseifner
+//        or the chain for long ones.
@@ -1,73 +1,272 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include "../reduce_local.h"
 
-void reduce_grid(const void *sendbuf, void *recvbuf, int count, MPI_Comm comm) {
-    int rank, size, coords[2], dims[2], periods[2], root[2];
-    MPI_Comm_rank(comm, &rank);
+// Rank in comm of the process at position pos along dimension dim of the line through this process
+static int line_rank(MPI_Comm comm, const int *coords, int dim, int pos) {
+    int other[2] = {coords[0], coords[1]}, rank;
+    other[dim] = pos;
+    MPI_Cart_rank(comm, other, &rank);
+    return rank;
+}
+
+// Segment length in bytes of the pipelined line reductions
+#define GRID_SEGMENT_BYTES (64 * 1024)
+
+// Reduce the vectors of one line of the grid along dimension dim into the process at position
+// root_pos of the line; data holds the partial result of this process and is overwritten.
+//
+// The processes on either side of the root form two chains that stream the vector towards it in
+// segments, so every link of the line carries a segment at the same time once the pipeline has
+// filled. On a periodic dimension the chains split the ring in halves and meet at the root from
+// both sides over the wrap-around link.
+static void reduce_line(void *data, int count, MPI_Datatype datatype, MPI_Op op, int dim, int root_pos,
+                        MPI_Comm comm) {
+    int coords[2], dims[2], periods[2];
     MPI_Cart_get(comm, 2, dims, periods, coords);
-    
-    int proc_count_x = dims[0];
-    int proc_count_y = dims[1];
-    
-    // Root is at the center of the grid
-    root[0] = proc_count_x / 2;
-    root[1] = proc_count_y / 2;
-    int root_rank;
-    MPI_Cart_rank(comm, root, &root_rank);
-    
-    double local_value = *((double *)sendbuf);
-    double reduced_value = local_value;
-    MPI_Status status;
-    
-    // Determine neighboring ranks
-    int left, right, up, down;
-    MPI_Cart_shift(comm, 0, 1, &left, &right);
-    MPI_Cart_shift(comm, 1, 1, &up, &down);
-    
-    // Reduction process: Send values towards the root process
-    if (coords[0] < root[0]) {
-        if (down != MPI_PROC_NULL) {
-            MPI_Recv(&local_value, count, MPI_DOUBLE, down, 0, comm, &status);
-            reduced_value += local_value;
-        }
-        if (up != MPI_PROC_NULL) {
-            MPI_Send(&reduced_value, count, MPI_DOUBLE, up, 0, comm);
+    int pos = coords[dim], size = dims[dim];
+    if (size == 1)
+        return;
+
+    // Upstream neighbors send their partial results to this process, which forwards the
+    // combination downstream towards the root
+    int upstream[2], num_upstream = 0, downstream = MPI_PROC_NULL;
+    if (periods[dim]) {
+        int up_length = size / 2, down_length = size - 1 - up_length;
+        int d = (pos - root_pos + size) % size;
+        if (d == 0) {
+            upstream[num_upstream++] = line_rank(comm, coords, dim, (pos + 1) % size);
+            if (down_length > 0)
+                upstream[num_upstream++] = line_rank(comm, coords, dim, (pos - 1 + size) % size);
+        } else if (d <= up_length) {
+            downstream = line_rank(comm, coords, dim, (pos - 1 + size) % size);
+            if (d < up_length)
+                upstream[num_upstream++] = line_rank(comm, coords, dim, (pos + 1) % size);
+        } else {
+            downstream = line_rank(comm, coords, dim, (pos + 1) % size);
+            if (size - d < down_length)
+                upstream[num_upstream++] = line_rank(comm, coords, dim, (pos - 1 + size) % size);
         }
-    } else if (coords[0] > root[0]) {
-        if (up != MPI_PROC_NULL) {
-            MPI_Recv(&local_value, count, MPI_DOUBLE, up, 0, comm, &status);
-            reduced_value += local_value;
+    } else {
+        if (pos >= root_pos && pos + 1 < size)
+            upstream[num_upstream++] = line_rank(comm, coords, dim, pos + 1);
+        if (pos <= root_pos && pos > 0)
+            upstream[num_upstream++] = line_rank(comm, coords, dim, pos - 1);
+        if (pos != root_pos)
+            downstream = line_rank(comm, coords, dim, pos > root_pos ? pos - 1 : pos + 1);
+    }
+
+    int type_size;
+    MPI_Type_size(datatype, &type_size);
+    int segment = type_size > 0 && GRID_SEGMENT_BYTES / type_size > 0 ? GRID_SEGMENT_BYTES / type_size : 1;
+    if (segment > count)
+        segment = count > 0 ? count : 1;
+    int num_segments = (count + segment - 1) / segment;
+
+    // Two receive slots per upstream neighbor: segment k + 1 arrives while k is combined
+    void *slot[2][2];
+    MPI_Request slot_request[2][2];
+    for (int u = 0; u < num_upstream; u++) {
+        for (int k = 0; k < 2; k++) {
+            slot[u][k] = buffer_alloc(segment, datatype);
+            slot_request[u][k] = MPI_REQUEST_NULL;
+            if (k < num_segments) {
+                int length = count - k * segment < segment ? count - k * segment : segment;
+                MPI_Irecv(slot[u][k], length, datatype, upstream[u], dim, comm, &slot_request[u][k]);
+            }
         }
-        if (down != MPI_PROC_NULL) {
-            MPI_Send(&reduced_value, count, MPI_DOUBLE, down, 0, comm);
+    }
+    MPI_Request *send_requests = malloc(num_segments * sizeof(MPI_Request));
+
+    for (int k = 0; k < num_segments; k++) {
+        int offset = k * segment;
+        int length = count - offset < segment ? count - offset : segment;
+        void *own = buffer_at(data, offset, datatype);
+        for (int u = 0; u < num_upstream; u++) {
+            MPI_Wait(&slot_request[u][k % 2], MPI_STATUS_IGNORE);
+            reduce_local(slot[u][k % 2], own, length, datatype, op);
+            if (k + 2 < num_segments) {
+                int next_offset = (k + 2) * segment;
+                int next_length = count - next_offset < segment ? count - next_offset : segment;
+                MPI_Irecv(slot[u][k % 2], next_length, datatype, upstream[u], dim, comm, &slot_request[u][k % 2]);
+            }
         }
+        send_requests[k] = MPI_REQUEST_NULL;
+        if (downstream != MPI_PROC_NULL)
+            MPI_Isend(own, length, datatype, downstream, dim, comm, &send_requests[k]);
     }
-    
-    if (coords[1] < root[1]) {
-        if (right != MPI_PROC_NULL) {
-            MPI_Recv(&local_value, count, MPI_DOUBLE, right, 0, comm, &status);
-            reduced_value += local_value;
+
+    MPI_Waitall(num_segments, send_requests, MPI_STATUSES_IGNORE);
+    free(send_requests);
+    for (int u = 0; u < num_upstream; u++)
+        for (int k = 0; k < 2; k++)
+            buffer_free(slot[u][k], datatype);
+}
+
+// Gather all vectors at root and combine them there in rank order of comm, so any op works
+static void reduce_rank_order(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op,
+                              int root, MPI_Comm comm) {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    void *gathered = rank == root ? buffer_alloc(count * size, datatype) : NULL;
+    MPI_Gather(sendbuf, count, datatype, gathered, count, datatype, root, comm);
+    if (rank == root) {
+        // recv = x_0 op (x_1 op (... op x_{p-1})); reduce_local computes inout = in op inout
+        buffer_copy(buffer_at(gathered, (MPI_Aint)count * (size - 1), datatype), recvbuf, count, datatype);
+        for (int r = size - 2; r >= 0; r--)
+            reduce_local(buffer_at(gathered, (MPI_Aint)count * r, datatype), recvbuf, count, datatype, op);
+        buffer_free(gathered, datatype);
+    }
+}
+
+// Reduce count elements of datatype with op towards the process at the center of the grid,
+// dimension by dimension: every column reduces into the root row, then the root row reduces into
+// the root. Works for any grid size, periodic or not. The lines combine the partial results out
+// of rank order, so non-commutative ops are gathered at the root and combined in rank order.
+void reduce_grid(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op,
+                 MPI_Comm comm) {
+    int coords[2], dims[2], periods[2], root[2];
+    MPI_Cart_get(comm, 2, dims, periods, coords);
+
+    // Root is at the center of the grid
+    root[0] = dims[0] / 2;
+    root[1] = dims[1] / 2;
+
+    if (!op_is_commutative(op)) {
+        int root_rank;
+        MPI_Cart_rank(comm, root, &root_rank);
+        reduce_rank_order(sendbuf, recvbuf, count, datatype, op, root_rank, comm);
+        return;
+    }
+
+    void *partial = buffer_alloc(count, datatype);
+    buffer_copy(sendbuf, partial, count, datatype);
+    reduce_line(partial, count, datatype, op, 0, root[0], comm);
+    if (coords[0] == root[0])
+        reduce_line(partial, count, datatype, op, 1, root[1], comm);
+
+    if (coords[0] == root[0] && coords[1] == root[1])
+        buffer_copy(partial, recvbuf, count, datatype);
+    buffer_free(partial, datatype);
+}
+
+// Allreduce within the line of the grid along dimension dim by recursive doubling. For a line
+// length p that is not a power of two, the first 2 * (p - pof2) processes fold in pairs first
+// and the odd ones get the result back at the end.
+static void allreduce_line(void *data, int count, MPI_Datatype datatype, MPI_Op op, int dim, MPI_Comm comm) {
+    int rank, coords[2], dims[2], periods[2];
+    MPI_Comm_rank(comm, &rank);
+    MPI_Cart_get(comm, 2, dims, periods, coords);
+    int pos = coords[dim], size = dims[dim];
+    int pof2 = 1;
+    while (pof2 * 2 <= size)
+        pof2 *= 2;
+    int rem = size - pof2;
+    void *incoming = buffer_alloc(count, datatype);
+
+    int new_pos = pos - rem;
+    if (pos < 2 * rem) {
+        if (pos % 2 == 1) {
+            MPI_Send(data, count, datatype, line_rank(comm, coords, dim, pos - 1), 0, comm);
+            new_pos = -1;
+        } else {
+            MPI_Recv(incoming, count, datatype, line_rank(comm, coords, dim, pos + 1), 0, comm,
+                     MPI_STATUS_IGNORE);
+            reduce_local(incoming, data, count, datatype, op);
+            new_pos = pos / 2;
         }
-        if (left != MPI_PROC_NULL) {
-            MPI_Send(&reduced_value, count, MPI_DOUBLE, left, 0, comm);
+    }
+
+    if (new_pos >= 0) {
+        for (int mask = 1; mask < pof2; mask <<= 1) {
+            int partner_new_pos = new_pos ^ mask;
+            int partner = line_rank(comm, coords, dim,
+                                    partner_new_pos < rem ? 2 * partner_new_pos : partner_new_pos + rem);
+            MPI_Sendrecv(data, count, datatype, partner, 1, incoming, count, datatype, partner, 1,
+                         comm, MPI_STATUS_IGNORE);
+            reduce_local(incoming, data, count, datatype, op);
         }
-    } else if (coords[1] > root[1]) {
-        if (left != MPI_PROC_NULL) {
-            MPI_Recv(&local_value, count, MPI_DOUBLE, left, 0, comm, &status);
-            reduced_value += local_value;
+    }
+
+    if (pos < 2 * rem) {
+        if (pos % 2 == 1)
+            MPI_Recv(data, count, datatype, line_rank(comm, coords, dim, pos - 1), 2, comm, MPI_STATUS_IGNORE);
+        else
+            MPI_Send(data, count, datatype, line_rank(comm, coords, dim, pos + 1), 2, comm);
+    }
+    buffer_free(incoming, datatype);
+}
+
+// Allreduce on the 2D grid: first within every row, then within every column, so each message
+// stays within one dimension of the Cartesian communicator. The lines combine out of rank order,
+// so non-commutative ops are reduced in rank order at rank 0 and broadcast from there.
+void allreduce_grid(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op,
+                    MPI_Comm comm) {
+    if (!op_is_commutative(op)) {
+        reduce_rank_order(sendbuf, recvbuf, count, datatype, op, 0, comm);
+        MPI_Bcast(recvbuf, count, datatype, 0, comm);
+        return;
+    }
+    buffer_copy(sendbuf, recvbuf, count, datatype);
+    allreduce_line(recvbuf, count, datatype, op, 1, comm);
+    allreduce_line(recvbuf, count, datatype, op, 0, comm);
+}
+
+// Time allreduce_grid against MPI_Allreduce (best of three) for 1, 8, 64, ... up to max_count
+// doubles and check that every process got the same result
+static void benchmark_allreduce(int max_count, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    double *data = malloc(max_count * sizeof(double));
+    double *grid = malloc(max_count * sizeof(double));
+    double *expected = malloc(max_count * sizeof(double));
+    for (int i = 0; i < max_count; i++)
+        data[i] = rank + i % 100;  // Small integers, so the sums are exact in any order
+
+    if (rank == 0)
+        printf("%10s %16s %16s\n", "count", "allreduce_grid", "MPI_Allreduce");
+    for (int count = 1; count <= max_count; count *= 8) {
+        double best[2] = {INFINITY, INFINITY};
+        for (int repetition = 0; repetition < 3; repetition++) {
+            for (int v = 0; v < 2; v++) {
+                MPI_Barrier(comm);
+                double start = MPI_Wtime();
+                if (v == 0)
+                    allreduce_grid(data, grid, count, MPI_DOUBLE, MPI_SUM, comm);
+                else
+                    MPI_Allreduce(data, expected, count, MPI_DOUBLE, MPI_SUM, comm);
+                double elapsed = MPI_Wtime() - start;
+                MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, comm);
+                if (elapsed < best[v])
+                    best[v] = elapsed;
+            }
         }
-        if (right != MPI_PROC_NULL) {
-            MPI_Send(&reduced_value, count, MPI_DOUBLE, right, 0, comm);
+        int mismatches = 0;
+        for (int i = 0; i < count; i++)
+            if (grid[i] != expected[i])
+                mismatches++;
+        MPI_Allreduce(MPI_IN_PLACE, &mismatches, 1, MPI_INT, MPI_SUM, comm);
+        if (rank == 0) {
+            printf("%10d %16.3e %16.3e", count, best[0], best[1]);
+            if (mismatches > 0)
+                printf("  (%d elements differ from MPI_Allreduce)", mismatches);
+            printf("\n");
         }
     }
-    
-    // The root process receives the final reduced value
-    if (rank == root_rank) {
-        *((double *)recvbuf) = reduced_value;
-        printf("Final reduced sum at root (Process %d): %f\n", rank, reduced_value);
-    }
+    free(data);
+    free(grid);
+    free(expected);
+}
+
+// The non-commutative "first operand": reduces to the vector of rank 0 only if the operands stay
+// in rank order
+static void op_first(void *in, void *inout, int *len, MPI_Datatype *datatype) {
+    (void)datatype;
+    memcpy(inout, in, *len * sizeof(double));
 }
 
 int main(int argc, char *argv[]) {
@@ -77,7 +276,8 @@ int main(int argc, char *argv[]) {
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
     
-    int dims[2] = {2, 2}; // Example 4x4 grid
+    int dims[2] = {0, 0}; // As square as the number of processes allows
+    MPI_Dims_create(size, 2, dims);
     int periods[2] = {0, 0};
     MPI_Comm cart_comm;
     
@@ -92,7 +292,71 @@ int main(int argc, char *argv[]) {
     printf("Process %d has local value: %.2f\n", rank, local_value);
     
     // Perform reduction
-    reduce_grid(&local_value, &result, 1, cart_comm);
+    reduce_grid(&local_value, &result, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+
+    int cart_rank, coords[2], root[2] = { dims[0] / 2, dims[1] / 2 };
+    MPI_Comm_rank(cart_comm, &cart_rank);
+    MPI_Cart_coords(cart_comm, cart_rank, 2, coords);
+    if (coords[0] == root[0] && coords[1] == root[1])
+        printf("Final reduced sum at root (Process %d): %f\n", cart_rank, result);
+
+    // Result on every process
+    double all_result;
+    allreduce_grid(&local_value, &all_result, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+    if (cart_rank == 0)
+        printf("Reduced sum on all processes (%d x %d grid): %f\n", dims[0], dims[1], all_result);
+
+    int max_count = argc > 1 ? atoi(argv[1]) : 1 << 18;
+
+    // Full vectors on a mesh and on a torus against MPI_Reduce at the root and MPI_Allreduce, with a
+    // commutative and a non-commutative op
+    MPI_Op first;
+    MPI_Op_create(op_first, 0, &first);
+    double *vector = malloc(max_count * sizeof(double));
+    double *grid_result = malloc(max_count * sizeof(double));
+    double *expected = malloc(max_count * sizeof(double));
+    for (int i = 0; i < max_count; i++)
+        vector[i] = rank * 10 + i % 7;
+    for (int periodic = 0; periodic < 2; periodic++) {
+        int grid_periods[2] = {periodic, periodic};
+        MPI_Comm grid_comm;
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, grid_periods, 0, &grid_comm);
+        int grid_rank, root_rank;
+        MPI_Comm_rank(grid_comm, &grid_rank);
+        MPI_Cart_rank(grid_comm, root, &root_rank);
+        for (int o = 0; o < 2; o++) {
+            MPI_Op op = o == 0 ? MPI_SUM : first;
+            reduce_grid(vector, grid_result, max_count, MPI_DOUBLE, op, grid_comm);
+            MPI_Reduce(vector, expected, max_count, MPI_DOUBLE, op, root_rank, grid_comm);
+            if (grid_rank == root_rank) {
+                int mismatches = 0;
+                for (int i = 0; i < max_count; i++)
+                    if (grid_result[i] != expected[i])
+                        mismatches++;
+                printf("reduce_grid (%s) of %d doubles on a %s: %d elements differ from MPI_Reduce\n",
+                       o == 0 ? "sum" : "first", max_count, periodic ? "torus" : "mesh", mismatches);
+            }
+
+            // Every process must end with the same result
+            allreduce_grid(vector, grid_result, max_count, MPI_DOUBLE, op, grid_comm);
+            MPI_Allreduce(vector, expected, max_count, MPI_DOUBLE, op, grid_comm);
+            int mismatches = 0;
+            for (int i = 0; i < max_count; i++)
+                if (grid_result[i] != expected[i])
+                    mismatches++;
+            MPI_Allreduce(MPI_IN_PLACE, &mismatches, 1, MPI_INT, MPI_SUM, grid_comm);
+            if (grid_rank == 0)
+                printf("allreduce_grid (%s) of %d doubles on a %s: %d elements differ from MPI_Allreduce\n",
+                       o == 0 ? "sum" : "first", max_count, periodic ? "torus" : "mesh", mismatches);
+        }
+        MPI_Comm_free(&grid_comm);
+    }
+    free(vector);
+    free(grid_result);
+    free(expected);
+    MPI_Op_free(&first);
+
+    benchmark_allreduce(max_count, cart_comm);
     
     MPI_Comm_free(&cart_comm);
     MPI_Finalize();
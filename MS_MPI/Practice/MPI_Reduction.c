@@ -1,44 +1,107 @@
 #include <mpi.h>
+#include <stdlib.h>
+#include <string.h>
 #define COUNT (32 * 1024 * 1024)
-#define BLOCK_SIZE (16 * 1024) // Example block size
+#define BLOCK_SIZE (16 * 1024) // Default block size, pass a different one to tune
+#define NUM_BUFFERS 3          // Blocks in flight per rank: NUM_BUFFERS - 1 receives and one send
 
-void Reduce_linear_array(float* sendbuf, float* recvbuf, MPI_Comm comm)
+// Length of block b when count elements are cut into blocks of block_size; the last one may be shorter
+static int block_length(int count, int block_size, int b)
+{
+    int rest = count - b * block_size;
+    return rest < block_size ? rest : block_size;
+}
+
+// Pipelined sum over a linear array of ranks: comm_size - 1 -> ... -> 1 -> 0, result in recvbuf on
+// rank 0. Every rank adds its own part to block b and passes it on while blocks b + 1, b + 2, ... are
+// still arriving, so for long vectors the time approaches count * sizeof(float) / BW independent of
+// the number of ranks. count need not be a multiple of block_size (block_size <= 0 uses BLOCK_SIZE).
+void Reduce_linear_array(const float* sendbuf, float* recvbuf, int count, int block_size, MPI_Comm comm)
 {
     int my_rank; MPI_Comm_rank(comm, &my_rank);
     int comm_size; MPI_Comm_size(comm, &comm_size);
 
-    if (my_rank > 0 && my_rank < comm_size - 1)
+    if (block_size <= 0)
+        block_size = BLOCK_SIZE;
+    int num_blocks = (count + block_size - 1) / block_size;
+
+    if (comm_size == 1)
+    {
+        memcpy(recvbuf, sendbuf, count * sizeof(float));
+    }
+    else if (my_rank > 0 && my_rank < comm_size - 1)
     {
-        int num_blocks = COUNT / BLOCK_SIZE;
-        float* temp = malloc(BLOCK_SIZE * sizeof(float));
-        MPI_Request req_recv, req_send;
+        // Every block travels through one of NUM_BUFFERS buffers: received from the right neighbor,
+        // own part added, sent to the left neighbor. A buffer is reused only after its send completed.
+        float* temp[NUM_BUFFERS];
+        MPI_Request req_recv[NUM_BUFFERS], req_send[NUM_BUFFERS];
+        for (int s = 0; s < NUM_BUFFERS; s++) {
+            temp[s] = malloc(block_size * sizeof(float));
+            req_recv[s] = req_send[s] = MPI_REQUEST_NULL;
+        }
+
+        for (int b = 0; b < NUM_BUFFERS - 1 && b < num_blocks; b++)
+            MPI_Irecv(temp[b], block_length(count, block_size, b), MPI_FLOAT, my_rank + 1, 0, comm, &req_recv[b]);
 
         for (int b = 0; b < num_blocks; b++) {
-            // Start receiving block b from right neighbor
-            MPI_Irecv(temp, BLOCK_SIZE, MPI_FLOAT, my_rank + 1, b, comm, &req_recv);
-
-            // Compute and send previous block (if not the first block)
-            if (b > 0) {
-                MPI_Wait(&req_recv, MPI_STATUS_IGNORE);
-                for (int i = 0; i < BLOCK_SIZE; i++)
-                    temp[i] += sendbuf[(b-1)*BLOCK_SIZE + i];
-                MPI_Isend(temp, BLOCK_SIZE, MPI_FLOAT, my_rank - 1, b-1, comm, &req_send);
-                MPI_Wait(&req_send, MPI_STATUS_IGNORE);
+            // Refill the buffer whose send was posted in the previous step with block b + NUM_BUFFERS - 1
+            int next = b + NUM_BUFFERS - 1;
+            if (next < num_blocks) {
+                int s = next % NUM_BUFFERS;
+                MPI_Wait(&req_send[s], MPI_STATUS_IGNORE);
+                MPI_Irecv(temp[s], block_length(count, block_size, next), MPI_FLOAT, my_rank + 1, 0, comm,
+                          &req_recv[s]);
             }
 
-            // For the last block, handle after loop
+            int s = b % NUM_BUFFERS;
+            int length = block_length(count, block_size, b);
+            const float* own = sendbuf + (size_t)b * block_size;
+            MPI_Wait(&req_recv[s], MPI_STATUS_IGNORE);
+            for (int i = 0; i < length; i++)
+                temp[s][i] += own[i];
+            MPI_Isend(temp[s], length, MPI_FLOAT, my_rank - 1, 0, comm, &req_send[s]);
         }
 
-        // Handle the last block
-        MPI_Wait(&req_recv, MPI_STATUS_IGNORE);
-        for (int i = 0; i < BLOCK_SIZE; i++)
-            temp[i] += sendbuf[(num_blocks-1)*BLOCK_SIZE + i];
-        MPI_Isend(temp, BLOCK_SIZE, MPI_FLOAT, my_rank - 1, num_blocks-1, comm, &req_send);
-        MPI_Wait(&req_send, MPI_STATUS_IGNORE);
+        MPI_Waitall(NUM_BUFFERS, req_send, MPI_STATUSES_IGNORE);
+        for (int s = 0; s < NUM_BUFFERS; s++)
+            free(temp[s]);
+    }
+    else if (my_rank == comm_size - 1)
+    {
+        // Start of the chain: send the own blocks straight from sendbuf, at most NUM_BUFFERS in flight
+        MPI_Request req_send[NUM_BUFFERS];
+        for (int s = 0; s < NUM_BUFFERS; s++)
+            req_send[s] = MPI_REQUEST_NULL;
+        for (int b = 0; b < num_blocks; b++) {
+            int s = b % NUM_BUFFERS;
+            MPI_Wait(&req_send[s], MPI_STATUS_IGNORE);
+            MPI_Isend(sendbuf + (size_t)b * block_size, block_length(count, block_size, b), MPI_FLOAT,
+                      my_rank - 1, 0, comm, &req_send[s]);
+        }
+        MPI_Waitall(NUM_BUFFERS, req_send, MPI_STATUSES_IGNORE);
+    }
+    else
+    {
+        // End of the chain: receive every block directly into its place in recvbuf and add the own part
+        MPI_Request req_recv[NUM_BUFFERS];
+        for (int s = 0; s < NUM_BUFFERS; s++)
+            req_recv[s] = MPI_REQUEST_NULL;
+        for (int b = 0; b < NUM_BUFFERS && b < num_blocks; b++)
+            MPI_Irecv(recvbuf + (size_t)b * block_size, block_length(count, block_size, b), MPI_FLOAT,
+                      my_rank + 1, 0, comm, &req_recv[b]);
 
-        free(temp);
+        for (int b = 0; b < num_blocks; b++) {
+            int s = b % NUM_BUFFERS;
+            int length = block_length(count, block_size, b);
+            float* result = recvbuf + (size_t)b * block_size;
+            const float* own = sendbuf + (size_t)b * block_size;
+            MPI_Wait(&req_recv[s], MPI_STATUS_IGNORE);
+            if (b + NUM_BUFFERS < num_blocks)
+                MPI_Irecv(recvbuf + (size_t)(b + NUM_BUFFERS) * block_size,
+                          block_length(count, block_size, b + NUM_BUFFERS), MPI_FLOAT, my_rank + 1, 0, comm,
+                          &req_recv[s]);
+            for (int i = 0; i < length; i++)
+                result[i] += own[i];
+        }
     }
-    else if (my_rank == 0 || my_rank == comm_size - 1)
-        //... Code and optimization of boundary cases not relevant in this task
-        ;
-}
\ No newline at end of file
+}
@@ -1,11 +1,14 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "../phase_timer.h"
+#include "../precision.h"
 
 
-// Swap two double pointer arrays
-void swap(double** a, double** b) {
-    double* temp = *a;
+// Swap two field pointers
+void swap(real_t** a, real_t** b) {
+    real_t* temp = *a;
     *a = *b;
     *b = temp;
 }
@@ -17,56 +20,97 @@ int main(int argc, char** args)
 // Here you have to insert the initialization of MPI and to determine the amount of
 // processes, the block size and the rank.
     MPI_Init(&argc, &args);
+    phase_timer timer;
+    phase_timer_init(&timer, 1);
+    phase_begin(&timer, PHASE_INIT);
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    int block_size = 512 * 1024 * 1024 / size;
-    if(512*1024*1024 % size < rank) block_size++;
-    
-
-double delta_t = 0.02;
+// The stencil coefficients are acc_t, so the update is evaluated in the precision of the build
+acc_t delta_t = 0.02;
 int grid_size = 512 * 1024 * 1024;
 int num_time_steps = 3000;
-double conductivity = 0.1;
+acc_t conductivity = 0.1;
+
+// Command line options: --n N (global grid size), --steps N (number of time steps),
+// --timing FILE (per-phase timing report, JSON for *.json, else CSV)
+const char* timing_path = NULL;
+for (int a = 1; a < argc; a++) {
+    if (strcmp(args[a], "--n") == 0 && a + 1 < argc) grid_size = atoi(args[++a]);
+    else if (strcmp(args[a], "--steps") == 0 && a + 1 < argc) num_time_steps = atoi(args[++a]);
+    else if (strcmp(args[a], "--timing") == 0 && a + 1 < argc) timing_path = args[++a];
+}
+timer.enabled = timing_path != NULL;
 
-double* T_k = (double*) malloc(sizeof(double) * grid_size);
-double* T_kn = (double*) malloc(sizeof(double) * block_size);
+// Every process only owns its block of the global grid. The first grid_size % size
+// processes get one cell more, and start is the global index of the first owned cell.
+    int block_size = grid_size / size;
+    int remainder = grid_size % size;
+    if (rank < remainder) block_size++;
+    int start = rank * (grid_size / size) + (rank < remainder ? rank : remainder);
 
-for (int i = 0; i < block_size; i++) {
-    T_k[i] = i;
+// The local arrays hold the block at [1, block_size] and one ghost cell on each side
+real_t* T_k = (real_t*) malloc(sizeof(real_t) * (block_size + 2));
+real_t* T_kn = (real_t*) malloc(sizeof(real_t) * (block_size + 2));
+
+for (int i = 1; i <= block_size; i++) {
+    T_k[i] = start + i - 1;
 }
+
+int left = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+int right = rank < size - 1 ? rank + 1 : MPI_PROC_NULL;
+phase_end(&timer, PHASE_INIT);
+
 for (int k = 0; k < num_time_steps; k++)
 {
 // Sub task c)
 // Here you have to insert the synchronization of the borders of the blocks of
-// adjacent processes
-    for (int i = 0; i < block_size; i++)
+// adjacent processes. The exchange is blocking, so all of it counts as waiting.
+    phase_begin(&timer, PHASE_EXCHANGE_WAIT);
+    MPI_Sendrecv(&T_k[1], 1, MPI_REAL_T, left, 0,
+                 &T_k[block_size + 1], 1, MPI_REAL_T, right, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&T_k[block_size], 1, MPI_REAL_T, right, 1,
+                 &T_k[0], 1, MPI_REAL_T, left, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    // At the ends of the global grid the stencil reflects at the border cell
+    if (left == MPI_PROC_NULL) T_k[0] = T_k[block_size > 1 ? 2 : 1];
+    if (right == MPI_PROC_NULL) T_k[block_size + 1] = T_k[block_size > 1 ? block_size - 1 : block_size];
+    phase_end(&timer, PHASE_EXCHANGE_WAIT);
+
+    phase_begin(&timer, PHASE_STENCIL);
+    for (int i = 1; i <= block_size; i++)
     {
-    int i_left = i != 0 ? i - 1 : 1 ;
-    int i_right = i != block_size - 1 ? i + 1 : i - 1;
-    double dTdt_i = conductivity * (- 2 * T_k[i] + T_k[i_left] + T_k[i_right]);
-    T_kn[i] = T_k[i] + delta_t * dTdt_i;
+    acc_t dTdt_i = conductivity * (- 2 * (acc_t)T_k[i] + T_k[i - 1] + T_k[i + 1]);
+    T_kn[i] = (real_t)(T_k[i] + delta_t * dTdt_i);
     }
+    phase_end(&timer, PHASE_STENCIL);
     swap(&T_k, &T_kn);
+    phase_step_end(&timer);
 }
 
-double T_average = 0;
-for (int i = 0; i < grid_size; i++)
-T_average += T_k[i];
-T_average = T_average / grid_size;
 // Sub task d)
 // Here you have to sum up and send T_average to the master process.
-int global_average = 0;
-MPI_Reduce(&T_average, &global_average, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+phase_begin(&timer, PHASE_REDUCE);
+double partial_sum = 0;
+for (int i = 1; i <= block_size; i++)
+partial_sum += T_k[i];
+double global_sum = 0;
+MPI_Reduce(&partial_sum, &global_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+phase_end(&timer, PHASE_REDUCE);
 
 // Sub task e)
 // Here you have to insert an if-condition, so that only the master process prints the
 // average temperature on the console.
 if (rank == 0){
-    printf("T_average: %f", T_average);
+    printf("T_average: %f\n", global_sum / grid_size);
 }
 
+phase_report(&timer, "heat_practice", timing_path, MPI_COMM_WORLD);
+
+free(T_k);
+free(T_kn);
+
 // Sub task f)
 // Here the finalisation of MPI is missing!
 MPI_Finalize();
@@ -0,0 +1,90 @@
+// Helpers shared by the heat solvers: the split of the global grid over the processes, grid
+// allocation with first-touch placement, the kernel multiversioning macro and the field
+// diagnostics. The grid layouts themselves differ between the solvers and stay in the programs.
+//
+// The functions are static, so every program includes its own copy of this header.
+#ifndef GRID_UTIL_H
+#define GRID_UTIL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "precision.h"
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static inline int omp_get_thread_num(void) { return 0; }
+static inline int omp_get_num_threads(void) { return 1; }
+static inline int omp_get_max_threads(void) { return 1; }
+static inline void omp_set_num_threads(int n) { (void)n; }
+#endif
+
+// The vectorized kernels are compiled for AVX-512, AVX2 and the baseline ISA; the loader
+// picks the best clone for the CPU at run time
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+static inline void swap(real_t** a, real_t** b) {
+    real_t* temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+// Balanced split of n cells over `parts` processes: the first n % parts processes get one cell
+// more. Sets the global offset and the number of cells of part `index`.
+static inline void block_range(int n, int parts, int index, int* offset, int* count) {
+    int base = n / parts;
+    int remainder = n % parts;
+    *count = base + (index < remainder ? 1 : 0);
+    *offset = index * base + (index < remainder ? index : remainder);
+}
+
+// Allocate a zeroed grid of `rows` rows (or planes) of row_length cells each. The rows are
+// first touched by the threads with the static schedule the stencils use over the same rows,
+// so their pages are placed on the NUMA node of the thread updating them.
+static inline real_t* alloc_rows_first_touch(int rows, int row_length) {
+    real_t* T = (real_t*)malloc(sizeof(real_t) * (size_t)rows * row_length);
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < rows; r++)
+        memset(T + (size_t)r * row_length, 0, sizeof(real_t) * row_length);
+    return T;
+}
+
+// Diagnostics of the field, reduced over all processes in a single MPI_Allreduce
+typedef struct {
+    double sum, sum_sq;
+    double min, max;
+} field_stats;
+
+static inline void field_stats_combine(void* in, void* inout, int* len, MPI_Datatype* type) {
+    (void)type;
+    const field_stats* a = (const field_stats*)in;
+    field_stats* b = (field_stats*)inout;
+    for (int i = 0; i < *len; i++) {
+        b[i].sum += a[i].sum;
+        b[i].sum_sq += a[i].sum_sq;
+        if (a[i].min < b[i].min) b[i].min = a[i].min;
+        if (a[i].max > b[i].max) b[i].max = a[i].max;
+    }
+}
+
+// Combine the local diagnostics of all processes of comm
+static inline field_stats field_stats_allreduce(field_stats local, MPI_Comm comm) {
+    MPI_Datatype stats_type;
+    MPI_Type_contiguous(4, MPI_DOUBLE, &stats_type);
+    MPI_Type_commit(&stats_type);
+    MPI_Op stats_op;
+    MPI_Op_create(field_stats_combine, 1, &stats_op);
+
+    field_stats global;
+    MPI_Allreduce(&local, &global, 1, stats_type, stats_op, comm);
+
+    MPI_Op_free(&stats_op);
+    MPI_Type_free(&stats_type);
+    return global;
+}
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+#include "phase_timer.h"
+#include "precision.h"
+#include "grid_util.h"
+
+// Geometry of a local sub-volume surrounded by a ghost layer of one cell. Owned cells are
+// addressed with x in [0, nx), y in [0, ny), z in [0, nz), the ghost layer with -1 and n.
+typedef struct {
+    int nx, ny, nz;     // number of owned cells
+    int sx, sy;         // strides of y and z including the ghost layer
+    int size;           // total number of cells including the ghost layer
+} grid_layout;
+
+grid_layout make_layout(int nx, int ny, int nz) {
+    grid_layout g;
+    g.nx = nx;
+    g.ny = ny;
+    g.nz = nz;
+    g.sx = nx + 2;
+    g.sy = g.sx * (ny + 2);
+    g.size = g.sy * (nz + 2);
+    return g;
+}
+
+static inline int idx(const grid_layout* g, int x, int y, int z) {
+    return (z + 1) * g->sy + (y + 1) * g->sx + x + 1;
+}
+
+// Allocate a zeroed grid, placed plane by plane (see grid_util.h)
+real_t* grid_alloc(const grid_layout* g) {
+    return alloc_rows_first_touch(g->nz + 2, g->sy);
+}
+
+// The six faces of the block; face 2 * d is the low side and face 2 * d + 1 the high side of
+// dimension d (0 = x, 1 = y, 2 = z)
+enum { NUM_FACES = 6 };
+
+// Requests and datatypes of the face exchange, created once for the whole run. With
+// `persistent` set, the requests are created once per time level with MPI_Send_init/MPI_Recv_init
+// and every step only calls MPI_Startall.
+typedef struct {
+    int neighbor[NUM_FACES];
+    MPI_Datatype send_type[NUM_FACES], recv_type[NUM_FACES];
+    MPI_Request requests[2 * NUM_FACES];
+    int persistent;
+    const real_t* bound[2];                         // the two time levels the requests are bound to
+    MPI_Request persistent_requests[2][2 * NUM_FACES];
+    MPI_Request* active;                            // requests of the exchange in flight
+    MPI_Comm comm;
+} halo_exchange;
+
+// Datatype selecting the box [x0, x0 + w) x [y0, y0 + h) x [z0, z0 + d) of the padded grid
+MPI_Datatype box_type(const grid_layout* g, int x0, int y0, int z0, int w, int h, int d) {
+    int sizes[3] = { g->nz + 2, g->ny + 2, g->nx + 2 };
+    int subsizes[3] = { d, h, w };
+    int starts[3] = { z0 + 1, y0 + 1, x0 + 1 };
+    MPI_Datatype t;
+    MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_REAL_T, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+// Subarray type of the owned face layer (send) or the ghost layer (recv) of one face
+MPI_Datatype face_type(const grid_layout* g, int face, int ghost) {
+    int n[3] = { g->nx, g->ny, g->nz };
+    int start[3] = { 0, 0, 0 };
+    int extent[3] = { g->nx, g->ny, g->nz };
+    int d = face / 2;
+    int high = face % 2;
+    extent[d] = 1;
+    if (ghost)
+        start[d] = high ? n[d] : -1;
+    else
+        start[d] = high ? n[d] - 1 : 0;
+    return box_type(g, start[0], start[1], start[2], extent[0], extent[1], extent[2]);
+}
+
+// Set up the exchange for the time levels T_a and T_b, which are swapped after every step
+void halo_init(halo_exchange* ex, const grid_layout* g, MPI_Comm comm, int persistent,
+               real_t* T_a, real_t* T_b) {
+    ex->comm = comm;
+    ex->persistent = persistent;
+    ex->active = ex->requests;
+    for (int d = 0; d < 3; d++)
+        MPI_Cart_shift(comm, d, 1, &ex->neighbor[2 * d], &ex->neighbor[2 * d + 1]);
+    for (int f = 0; f < NUM_FACES; f++) {
+        ex->send_type[f] = face_type(g, f, 0);
+        ex->recv_type[f] = face_type(g, f, 1);
+    }
+    if (!persistent) return;
+
+    ex->bound[0] = T_a;
+    ex->bound[1] = T_b;
+    for (int s = 0; s < 2; s++) {
+        real_t* T = s == 0 ? T_a : T_b;
+        for (int f = 0; f < NUM_FACES; f++) {
+            // Messages are tagged with the face they leave through; the message arriving
+            // through face f left the neighbor through the opposite face f ^ 1
+            MPI_Recv_init(T, 1, ex->recv_type[f], ex->neighbor[f], f ^ 1, comm,
+                          &ex->persistent_requests[s][f]);
+            MPI_Send_init(T, 1, ex->send_type[f], ex->neighbor[f], f, comm,
+                          &ex->persistent_requests[s][NUM_FACES + f]);
+        }
+    }
+}
+
+void halo_free(halo_exchange* ex) {
+    for (int f = 0; f < NUM_FACES; f++) {
+        MPI_Type_free(&ex->send_type[f]);
+        MPI_Type_free(&ex->recv_type[f]);
+    }
+    if (!ex->persistent) return;
+    for (int s = 0; s < 2; s++)
+        for (int r = 0; r < 2 * NUM_FACES; r++)
+            MPI_Request_free(&ex->persistent_requests[s][r]);
+}
+
+// Post the non-blocking exchange of the six faces
+void halo_start(halo_exchange* ex, real_t* T) {
+    if (ex->persistent) {
+        ex->active = ex->persistent_requests[T == ex->bound[0] ? 0 : 1];
+        MPI_Startall(2 * NUM_FACES, ex->active);
+        return;
+    }
+    ex->active = ex->requests;
+    for (int f = 0; f < NUM_FACES; f++)
+        MPI_Irecv(T, 1, ex->recv_type[f], ex->neighbor[f], f ^ 1, ex->comm, &ex->requests[f]);
+    for (int f = 0; f < NUM_FACES; f++)
+        MPI_Isend(T, 1, ex->send_type[f], ex->neighbor[f], f, ex->comm, &ex->requests[NUM_FACES + f]);
+}
+
+// Wait for the exchange, then mirror the owned faces into the ghost layer on the sides without
+// a neighbor, so that no heat flows across the border of the global grid
+void halo_finish(halo_exchange* ex, real_t* T, const grid_layout* g) {
+    MPI_Waitall(2 * NUM_FACES, ex->active, MPI_STATUSES_IGNORE);
+    if (ex->neighbor[0] == MPI_PROC_NULL || ex->neighbor[1] == MPI_PROC_NULL) {
+        for (int z = 0; z < g->nz; z++)
+            for (int y = 0; y < g->ny; y++) {
+                if (ex->neighbor[0] == MPI_PROC_NULL) T[idx(g, -1, y, z)] = T[idx(g, 0, y, z)];
+                if (ex->neighbor[1] == MPI_PROC_NULL) T[idx(g, g->nx, y, z)] = T[idx(g, g->nx - 1, y, z)];
+            }
+    }
+    if (ex->neighbor[2] == MPI_PROC_NULL || ex->neighbor[3] == MPI_PROC_NULL) {
+        for (int z = 0; z < g->nz; z++) {
+            if (ex->neighbor[2] == MPI_PROC_NULL)
+                memcpy(T + idx(g, 0, -1, z), T + idx(g, 0, 0, z), sizeof(real_t) * g->nx);
+            if (ex->neighbor[3] == MPI_PROC_NULL)
+                memcpy(T + idx(g, 0, g->ny, z), T + idx(g, 0, g->ny - 1, z), sizeof(real_t) * g->nx);
+        }
+    }
+    for (int y = 0; y < g->ny; y++) {
+        if (ex->neighbor[4] == MPI_PROC_NULL)
+            memcpy(T + idx(g, 0, y, -1), T + idx(g, 0, y, 0), sizeof(real_t) * g->nx);
+        if (ex->neighbor[5] == MPI_PROC_NULL)
+            memcpy(T + idx(g, 0, y, g->nz), T + idx(g, 0, y, g->nz - 1), sizeof(real_t) * g->nx);
+    }
+}
+
+// Update n cells of one row with the 7-point stencil. c points to the first cell, sx and sy
+// are the strides to the neighbors in y and z; c[-1] and c[n] must be readable. The sum is
+// evaluated in acc_t (see precision.h).
+SIMD_CLONES
+void stencil_row(const real_t* restrict c, real_t* restrict out, int n, int sx, int sy,
+                 acc_t conductivity, acc_t delta_t) {
+    for (int x = 0; x < n; x++) {
+        acc_t dTdt = conductivity * (-6 * (acc_t)c[x] + c[x - 1] + c[x + 1] +
+                                     c[x - sx] + c[x + sx] + c[x - sy] + c[x + sy]);
+        out[x] = (real_t)(c[x] + delta_t * dTdt);
+    }
+}
+
+// Update the cells in [x0, x1) x [y0, y1) x [z0, z1)
+void compute_box(const real_t* T_k, real_t* T_kn, const grid_layout* g, int x0, int x1, int y0, int y1,
+                 int z0, int z1, double conductivity, double delta_t) {
+    if (x1 <= x0 || y1 <= y0) return;
+    #pragma omp parallel for collapse(2) schedule(static) if ((z1 - z0) * (y1 - y0) * (x1 - x0) >= 4096)
+    for (int z = z0; z < z1; z++) {
+        for (int y = y0; y < y1; y++) {
+            int i = idx(g, x0, y, z);
+            stencil_row(T_k + i, T_kn + i, x1 - x0, g->sx, g->sy, conductivity, delta_t);
+        }
+    }
+}
+
+// Update the cells which do not depend on the ghost layer
+void compute_interior(const real_t* T_k, real_t* T_kn, const grid_layout* g,
+                      double conductivity, double delta_t) {
+    compute_box(T_k, T_kn, g, 1, g->nx - 1, 1, g->ny - 1, 1, g->nz - 1, conductivity, delta_t);
+}
+
+// Update the outermost layer of the block, which needs the ghost layer
+void compute_boundary(const real_t* T_k, real_t* T_kn, const grid_layout* g,
+                      double conductivity, double delta_t) {
+    int nx = g->nx, ny = g->ny, nz = g->nz;
+    // Bottom and top planes
+    compute_box(T_k, T_kn, g, 0, nx, 0, ny, 0, 1, conductivity, delta_t);
+    if (nz > 1)
+        compute_box(T_k, T_kn, g, 0, nx, 0, ny, nz - 1, nz, conductivity, delta_t);
+    // Front and back rows of the remaining planes
+    compute_box(T_k, T_kn, g, 0, nx, 0, 1, 1, nz - 1, conductivity, delta_t);
+    if (ny > 1)
+        compute_box(T_k, T_kn, g, 0, nx, ny - 1, ny, 1, nz - 1, conductivity, delta_t);
+    // Left and right columns of the remaining rows
+    compute_box(T_k, T_kn, g, 0, 1, 1, ny - 1, 1, nz - 1, conductivity, delta_t);
+    if (nx > 1)
+        compute_box(T_k, T_kn, g, nx - 1, nx, 1, ny - 1, 1, nz - 1, conductivity, delta_t);
+}
+
+// Diagnostics of the owned cells, reduced over all processes in a single MPI_Allreduce
+field_stats compute_field_stats(const real_t* T, const grid_layout* g, MPI_Comm comm) {
+    double sum = 0.0, sum_sq = 0.0, min = INFINITY, max = -INFINITY;
+    #pragma omp parallel for collapse(2) schedule(static) reduction(+:sum, sum_sq) reduction(min:min) reduction(max:max)
+    for (int z = 0; z < g->nz; z++) {
+        for (int y = 0; y < g->ny; y++) {
+            for (int x = 0; x < g->nx; x++) {
+                double v = T[idx(g, x, y, z)];
+                sum += v;
+                sum_sq += v * v;
+                if (v < min) min = v;
+                if (v > max) max = v;
+            }
+        }
+    }
+    field_stats local = { sum, sum_sq, min, max };
+    return field_stats_allreduce(local, comm);
+}
+
+int main(int argc, char** argv) {
+    // Only the master thread calls MPI, the thread team works on the stencil in between
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    phase_timer timer;
+    phase_timer_init(&timer, 1);
+    phase_begin(&timer, PHASE_INIT);
+
+    int rank, size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Simulation parameters
+    double delta_t = 0.02;
+    int grid_size[3] = {128, 128, 128};
+    int num_time_steps = 1000;
+    double conductivity = 0.1;
+
+    // Command line options:
+    //   --overlap      compute the interior while the halos are in flight
+    //   --persistent   exchange with persistent requests
+    //   --threads N    threads per process (default: OMP_NUM_THREADS)
+    //   --nx N --ny N --nz N  global grid size
+    //   --steps N      number of time steps
+    //   --timing FILE  write the per-phase timing report to FILE (JSON for *.json, else CSV,
+    //                  - for stdout)
+    int overlap = 0;
+    int persistent = 0;
+    const char* timing_path = NULL;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--overlap") == 0) overlap = 1;
+        else if (strcmp(argv[a], "--persistent") == 0) persistent = 1;
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) omp_set_num_threads(atoi(argv[++a]));
+        else if (strcmp(argv[a], "--nx") == 0 && a + 1 < argc) grid_size[0] = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--ny") == 0 && a + 1 < argc) grid_size[1] = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--nz") == 0 && a + 1 < argc) grid_size[2] = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--steps") == 0 && a + 1 < argc) num_time_steps = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--timing") == 0 && a + 1 < argc) timing_path = argv[++a];
+    }
+    // Only time the phases if a report is requested
+    timer.enabled = timing_path != NULL;
+
+    // Determine the number of processes in each dimension
+    int dims[3] = {0, 0, 0}; // Let MPI decide the dimensions
+    MPI_Dims_create(size, 3, dims);
+
+    // Define periodicity (non-periodic)
+    int periods[3] = {0, 0, 0};
+    MPI_Comm comm_cart;
+    MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &comm_cart);
+
+    // Get the Cartesian coordinates of the current process (ranks may be reordered)
+    int coords[3];
+    MPI_Comm_rank(comm_cart, &rank);
+    MPI_Cart_coords(comm_cart, rank, 3, coords);
+    if (rank == 0) {
+        printf("Process grid: %d x %d x %d, threads per process: %d, precision: %s\n",
+               dims[0], dims[1], dims[2], omp_get_max_threads(), PRECISION_NAME);
+        if (provided < MPI_THREAD_FUNNELED)
+            printf("Warning: MPI does not provide MPI_THREAD_FUNNELED\n");
+    }
+
+    // Determine the block size and the global offset of the block for each process
+    int bs[3], offset[3];
+    for (int d = 0; d < 3; d++) {
+        if (grid_size[d] < dims[d]) {
+            if (rank == 0)
+                fprintf(stderr, "The %d x %d x %d grid is too small for %d x %d x %d processes\n",
+                        grid_size[0], grid_size[1], grid_size[2], dims[0], dims[1], dims[2]);
+            MPI_Abort(comm_cart, EXIT_FAILURE);
+        }
+        block_range(grid_size[d], dims[d], coords[d], &offset[d], &bs[d]);
+    }
+
+    // Allocate memory for the local sub-volumes including the ghost layer
+    grid_layout g = make_layout(bs[0], bs[1], bs[2]);
+    real_t* T_k = grid_alloc(&g);
+    real_t* T_kn = grid_alloc(&g);
+
+    // Initialize the sub-volume with some values
+    #pragma omp parallel for schedule(static)
+    for (int z = 0; z < bs[2]; z++) {
+        for (int y = 0; y < bs[1]; y++) {
+            for (int x = 0; x < bs[0]; x++) {
+                T_k[idx(&g, x, y, z)] = offset[0] + x + offset[1] + y + offset[2] + z;
+            }
+        }
+    }
+
+    halo_exchange ex;
+    halo_init(&ex, &g, comm_cart, persistent, T_k, T_kn);
+
+    double t_interior = 0.0, t_wait = 0.0;
+    phase_end(&timer, PHASE_INIT);
+
+    // Time-stepping loop
+    for (int k = 0; k < num_time_steps; k++) {
+        double t0 = MPI_Wtime();
+        phase_begin(&timer, PHASE_EXCHANGE_POST);
+        halo_start(&ex, T_k);
+        phase_end(&timer, PHASE_EXCHANGE_POST);
+
+        double t1 = MPI_Wtime();
+        if (overlap) {
+            phase_begin(&timer, PHASE_STENCIL);
+            compute_interior(T_k, T_kn, &g, conductivity, delta_t);
+            phase_end(&timer, PHASE_STENCIL);
+            t_interior += MPI_Wtime() - t1;
+        }
+
+        double t2 = MPI_Wtime();
+        phase_begin(&timer, PHASE_EXCHANGE_WAIT);
+        halo_finish(&ex, T_k, &g);
+        phase_end(&timer, PHASE_EXCHANGE_WAIT);
+        t_wait += MPI_Wtime() - t2 + (t1 - t0);
+
+        // Compute the heat equation for the local sub-volume
+        phase_begin(&timer, PHASE_STENCIL);
+        if (!overlap) {
+            compute_interior(T_k, T_kn, &g, conductivity, delta_t);
+        }
+        compute_boundary(T_k, T_kn, &g, conductivity, delta_t);
+        phase_end(&timer, PHASE_STENCIL);
+
+        // Swap the grids
+        swap(&T_k, &T_kn);
+        phase_step_end(&timer);
+    }
+
+    // Report the exposed communication time per step (averaged over processes)
+    if (num_time_steps > 0) {
+        double local_times[2] = {t_interior / num_time_steps, t_wait / num_time_steps};
+        double sum_times[2];
+        MPI_Reduce(local_times, sum_times, 2, MPI_DOUBLE, MPI_SUM, 0, comm_cart);
+        if (rank == 0) {
+            printf("Per step (avg over %d processes): interior during exchange %.3e s, exposed wait %.3e s\n",
+                   size, sum_times[0] / size, sum_times[1] / size);
+        }
+    }
+
+    // Reduce the diagnostics over all processes
+    phase_begin(&timer, PHASE_REDUCE);
+    field_stats stats = compute_field_stats(T_k, &g, comm_cart);
+    phase_end(&timer, PHASE_REDUCE);
+    double num_cells = (double)grid_size[0] * grid_size[1] * grid_size[2];
+    if (rank == 0) {
+        printf("T_average: %f \n", stats.sum / num_cells);
+        printf("T_min: %f, T_max: %f, L2 norm: %e\n", stats.min, stats.max, sqrt(stats.sum_sq));
+    }
+    phase_report(&timer, "heat3d", timing_path, comm_cart);
+
+    // Free allocated memory
+    free(T_k);
+    free(T_kn);
+    halo_free(&ex);
+
+    MPI_Comm_free(&comm_cart);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Lightweight per-phase timing of the heat solvers, based on MPI_Wtime.
+//
+// Every rank accumulates the time spent in a few named phases. At the end of each time step,
+// the time of every phase entered during the step goes into a histogram with logarithmic bins.
+// phase_report reduces the totals and the histograms to rank 0. Rank 0 writes the min/avg/max
+// over the ranks, the imbalance max/avg and the summed histograms, as JSON when the file name
+// ends in ".json" and as CSV otherwise.
+//
+// The functions are static, so every program includes its own copy of this header.
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+
+enum { PHASE_INIT, PHASE_EXCHANGE_POST, PHASE_EXCHANGE_WAIT, PHASE_STENCIL, PHASE_REDUCE, PHASE_IO,
+       NUM_PHASES };
+
+static const char* const phase_names[NUM_PHASES] = {
+    "init", "exchange_post", "exchange_wait", "stencil", "reduce", "io"
+};
+
+// Bin 0 counts steps below 1 us, bin b > 0 steps in [2^(b-1), 2^b) us; the last bin is open
+#define PHASE_HIST_BINS 32
+
+typedef struct {
+    int enabled;
+    double started[NUM_PHASES];     // start of the running region, or 0
+    double total[NUM_PHASES];       // accumulated over the run
+    double step[NUM_PHASES];        // accumulated in the current step
+    int entered[NUM_PHASES];        // phase was entered in the current step
+    long long hist[NUM_PHASES][PHASE_HIST_BINS];
+    long long steps;
+} phase_timer;
+
+static void phase_timer_init(phase_timer* t, int enabled) {
+    memset(t, 0, sizeof(*t));
+    t->enabled = enabled;
+}
+
+static inline void phase_begin(phase_timer* t, int phase) {
+    if (t->enabled) t->started[phase] = MPI_Wtime();
+}
+
+static inline void phase_end(phase_timer* t, int phase) {
+    if (!t->enabled) return;
+    double dt = MPI_Wtime() - t->started[phase];
+    t->total[phase] += dt;
+    t->step[phase] += dt;
+    t->entered[phase] = 1;
+}
+
+static int phase_hist_bin(double seconds) {
+    double us = seconds * 1e6;
+    int b = 0;
+    while (us >= 1.0 && b < PHASE_HIST_BINS - 1) {
+        us *= 0.5;
+        b++;
+    }
+    return b;
+}
+
+// Close the current time step (or batch of steps advanced together) and bin its phase times.
+// The initialization is not part of any step and only counts in the totals.
+static void phase_step_end(phase_timer* t) {
+    if (!t->enabled) return;
+    for (int p = 0; p < NUM_PHASES; p++) {
+        if (t->entered[p] && p != PHASE_INIT)
+            t->hist[p][phase_hist_bin(t->step[p])]++;
+        t->step[p] = 0.0;
+        t->entered[p] = 0;
+    }
+    t->steps++;
+}
+
+static void phase_write_json(FILE* f, const char* program, int num_ranks, long long steps,
+                             const double* min, const double* avg, const double* max,
+                             long long (*hist)[PHASE_HIST_BINS]) {
+    fprintf(f, "{\n  \"program\": \"%s\",\n  \"ranks\": %d,\n  \"steps\": %lld,\n", program, num_ranks, steps);
+    fprintf(f, "  \"histogram_bins_us\": \"bin 0: < 1, bin b: [2^(b-1), 2^b)\",\n  \"phases\": [\n");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(f, "    {\"name\": \"%s\", \"min_s\": %.9e, \"avg_s\": %.9e, \"max_s\": %.9e, "
+                "\"imbalance\": %.4f, \"histogram\": [", phase_names[p], min[p], avg[p], max[p],
+                avg[p] > 0 ? max[p] / avg[p] : 1.0);
+        for (int b = 0; b < PHASE_HIST_BINS; b++)
+            fprintf(f, "%s%lld", b ? ", " : "", hist[p][b]);
+        fprintf(f, "]}%s\n", p < NUM_PHASES - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void phase_write_csv(FILE* f, const char* program, int num_ranks, long long steps,
+                            const double* min, const double* avg, const double* max,
+                            long long (*hist)[PHASE_HIST_BINS]) {
+    fprintf(f, "program,ranks,steps,phase,min_s,avg_s,max_s,imbalance");
+    for (int b = 0; b < PHASE_HIST_BINS; b++)
+        fprintf(f, ",bin_%d", b);
+    fprintf(f, "\n");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(f, "%s,%d,%lld,%s,%.9e,%.9e,%.9e,%.4f", program, num_ranks, steps, phase_names[p],
+                min[p], avg[p], max[p], avg[p] > 0 ? max[p] / avg[p] : 1.0);
+        for (int b = 0; b < PHASE_HIST_BINS; b++)
+            fprintf(f, ",%lld", hist[p][b]);
+        fprintf(f, "\n");
+    }
+}
+
+// Reduce the timings of all ranks of comm to rank 0 and write the report to path.
+// Collective; does nothing if the timer is disabled or path is NULL.
+static void phase_report(const phase_timer* t, const char* program, const char* path, MPI_Comm comm) {
+    if (!t->enabled || path == NULL) return;
+    int rank, num_ranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    double min[NUM_PHASES], max[NUM_PHASES], avg[NUM_PHASES];
+    long long hist[NUM_PHASES][PHASE_HIST_BINS];
+    MPI_Reduce(t->total, min, NUM_PHASES, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(t->total, max, NUM_PHASES, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(t->total, avg, NUM_PHASES, MPI_DOUBLE, MPI_SUM, 0, comm);
+    MPI_Reduce(t->hist, hist, NUM_PHASES * PHASE_HIST_BINS, MPI_LONG_LONG, MPI_SUM, 0, comm);
+    if (rank != 0) return;
+
+    for (int p = 0; p < NUM_PHASES; p++)
+        avg[p] /= num_ranks;
+    FILE* f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write the timing report to %s\n", path);
+        return;
+    }
+    size_t len = strlen(path);
+    if (len >= 5 && strcmp(path + len - 5, ".json") == 0)
+        phase_write_json(f, program, num_ranks, t->steps, min, avg, max, hist);
+    else
+        phase_write_csv(f, program, num_ranks, t->steps, min, avg, max, hist);
+    if (f != stdout) fclose(f);
+}
+
+#endif
@@ -0,0 +1,30 @@
+// Element type of the heat fields, chosen at compile time:
+//   default       double storage and arithmetic
+//   -DHEAT_FLOAT  float storage and arithmetic
+//   -DHEAT_MIXED  float storage, the stencil accumulates in double
+// real_t is the type the fields are stored and communicated in, and MPI_REAL_T is the matching
+// MPI datatype. acc_t is the type the stencil sums are evaluated in. Global reductions (sums,
+// norms, residuals) always use double.
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <mpi.h>
+
+#if defined(HEAT_FLOAT)
+typedef float real_t;
+typedef float acc_t;
+#define MPI_REAL_T MPI_FLOAT
+#define PRECISION_NAME "float"
+#elif defined(HEAT_MIXED)
+typedef float real_t;
+typedef double acc_t;
+#define MPI_REAL_T MPI_FLOAT
+#define PRECISION_NAME "mixed"
+#else
+typedef double real_t;
+typedef double acc_t;
+#define MPI_REAL_T MPI_DOUBLE
+#define PRECISION_NAME "double"
+#endif
+
+#endif
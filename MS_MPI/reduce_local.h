@@ -0,0 +1,100 @@
+// Building blocks of the hand-written reductions: local combination of two buffers with any
+// MPI_Op and buffers of count elements of any MPI_Datatype.
+//
+// reduce_local computes inout = in op inout like MPI_Reduce_local. The common sums, maxima and
+// minima of int, float and double use plain loops the compiler vectorizes. Every other combination,
+// including user-defined ops, goes through MPI_Reduce_local.
+//
+// The functions are static, so every program includes its own copy of this header.
+#ifndef REDUCE_LOCAL_H
+#define REDUCE_LOCAL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#define REDUCE_LOCAL_LOOP(T, in, inout, count, EXPR)                 \
+    do {                                                             \
+        const T* restrict a = (const T*)(in);                        \
+        T* restrict b = (T*)(inout);                                 \
+        for (int i = 0; i < (count); i++)                            \
+            b[i] = EXPR;                                             \
+    } while (0)
+
+#define REDUCE_LOCAL_OPS(T, in, inout, count, op)                                       \
+    do {                                                                                \
+        if ((op) == MPI_SUM) { REDUCE_LOCAL_LOOP(T, in, inout, count, a[i] + b[i]); return; }            \
+        if ((op) == MPI_MAX) { REDUCE_LOCAL_LOOP(T, in, inout, count, a[i] > b[i] ? a[i] : b[i]); return; } \
+        if ((op) == MPI_MIN) { REDUCE_LOCAL_LOOP(T, in, inout, count, a[i] < b[i] ? a[i] : b[i]); return; } \
+    } while (0)
+
+static inline void reduce_local(const void* in, void* inout, int count, MPI_Datatype datatype, MPI_Op op)
+{
+    if (count <= 0)
+        return;
+    if (datatype == MPI_INT)
+        REDUCE_LOCAL_OPS(int, in, inout, count, op);
+    else if (datatype == MPI_FLOAT)
+        REDUCE_LOCAL_OPS(float, in, inout, count, op);
+    else if (datatype == MPI_DOUBLE)
+        REDUCE_LOCAL_OPS(double, in, inout, count, op);
+    MPI_Reduce_local(in, inout, count, datatype, op);
+}
+
+// Whether the operands of op may be combined in any order. The tree algorithms combine
+// partial results out of rank order and need this.
+static inline int op_is_commutative(MPI_Op op)
+{
+    int commute;
+    MPI_Op_commutative(op, &commute);
+    return commute;
+}
+
+// Distance in bytes between consecutive elements
+static inline MPI_Aint type_extent(MPI_Datatype datatype)
+{
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    return extent;
+}
+
+// Allocate a buffer for count elements. Types with a non-zero lower bound get a pointer
+// shifted so that all elements fall into the allocation; free it with buffer_free.
+static inline void* buffer_alloc(int count, MPI_Datatype datatype)
+{
+    MPI_Aint true_lb, true_extent;
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    MPI_Aint span = count > 0 ? (count - 1) * type_extent(datatype) + true_extent : 1;
+    return (char*)malloc(span) - true_lb;
+}
+
+static inline void buffer_free(void* buffer, MPI_Datatype datatype)
+{
+    if (buffer == NULL)
+        return;
+    MPI_Aint true_lb, true_extent;
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    free((char*)buffer + true_lb);
+}
+
+// Copy count elements. Contiguous types are copied with memcpy, all others by a message to self.
+static inline void buffer_copy(const void* src, void* dst, int count, MPI_Datatype datatype)
+{
+    int size;
+    MPI_Aint true_lb, true_extent;
+    MPI_Type_size(datatype, &size);
+    MPI_Type_get_true_extent(datatype, &true_lb, &true_extent);
+    if (true_lb == 0 && size == type_extent(datatype) && true_extent == size)
+        memcpy(dst, src, (size_t)count * size);
+    else
+        MPI_Sendrecv(src, count, datatype, 0, 0, dst, count, datatype, 0, 0, MPI_COMM_SELF,
+                     MPI_STATUS_IGNORE);
+}
+
+// Address of element i of a buffer
+static inline void* buffer_at(const void* buffer, MPI_Aint i, MPI_Datatype datatype)
+{
+    return (char*)buffer + i * type_extent(datatype);
+}
+
+#endif
@@ -1,18 +1,891 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <mpi.h>
+#include "phase_timer.h"
+#include "precision.h"
+#include "grid_util.h"
 
-void swap(double** a, double** b) {
-    double* temp = *a;
-    *a = *b;
-    *b = temp;
+// Geometry of a local sub-grid surrounded by a ghost ring of width `ghost`.
+// Owned cells are addressed with x in [0, nx) and y in [0, ny), the ghost ring with
+// x in [-ghost, 0) or [nx, nx + ghost) and likewise for y.
+typedef struct {
+    int nx, ny;     // number of owned cells
+    int ghost;      // width of the ghost ring
+    int stride;     // length of a row including the ghost ring
+    int size;       // total number of cells including the ghost ring
+} grid_layout;
+
+grid_layout make_layout(int nx, int ny, int ghost) {
+    grid_layout g;
+    g.nx = nx;
+    g.ny = ny;
+    g.ghost = ghost;
+    g.stride = nx + 2 * ghost;
+    g.size = g.stride * (ny + 2 * ghost);
+    return g;
+}
+
+static inline int idx(const grid_layout* g, int x, int y) {
+    return (y + g->ghost) * g->stride + x + g->ghost;
+}
+
+// Allocate a zeroed grid, placed row by row (see grid_util.h)
+real_t* grid_alloc(const grid_layout* g) {
+    return alloc_rows_first_touch(g->ny + 2 * g->ghost, g->stride);
+}
+
+// Copy the rectangle [x0, x0 + w) x [y0, y0 + h) of the grid into a contiguous buffer
+void pack_block(const real_t* T, const grid_layout* g, int x0, int y0, int w, int h, real_t* buf) {
+    for (int y = 0; y < h; y++)
+        memcpy(buf + y * w, T + idx(g, x0, y0 + y), sizeof(real_t) * w);
+}
+
+// Copy a contiguous buffer into the rectangle [x0, x0 + w) x [y0, y0 + h) of the grid
+void unpack_block(real_t* T, const grid_layout* g, int x0, int y0, int w, int h, const real_t* buf) {
+    for (int y = 0; y < h; y++)
+        memcpy(T + idx(g, x0, y0 + y), buf + y * w, sizeof(real_t) * w);
+}
+
+// Neighbor directions; the first four exchange the edges, the last four the corners of the
+// ghost ring, which are only needed for ghost rings wider than one cell
+enum { DOWN, UP, LEFT, RIGHT, DOWN_LEFT, DOWN_RIGHT, UP_LEFT, UP_RIGHT, NUM_DIRECTIONS };
+const int dir_dx[NUM_DIRECTIONS] = { 0, 0, -1, 1, -1, 1, -1, 1 };
+const int dir_dy[NUM_DIRECTIONS] = { -1, 1, 0, 0, -1, -1, 1, 1 };
+const int dir_opposite[NUM_DIRECTIONS] = { UP, DOWN, RIGHT, LEFT, UP_RIGHT, UP_LEFT, DOWN_RIGHT, DOWN_LEFT };
+
+// Exchange backends:
+//   HALO_P2P         pack the strips and send them with MPI_Isend/MPI_Irecv
+//   HALO_PERSISTENT  persistent requests created once per time level with MPI_Send_init/MPI_Recv_init,
+//                    so a time step only calls MPI_Startall
+//   HALO_NEIGHBOR    one MPI_Neighbor_alltoallw on the process topology
+//   HALO_INEIGHBOR   one MPI_Ineighbor_alltoallw, which can overlap with the interior update
+// All but HALO_P2P describe the strips by committed subarray datatypes on the padded grid and
+// need no packing.
+enum { HALO_P2P, HALO_PERSISTENT, HALO_NEIGHBOR, HALO_INEIGHBOR };
+
+// Buffers and requests of the halo exchange, allocated once for the whole run
+typedef struct {
+    int num_dirs;
+    int neighbor[NUM_DIRECTIONS];
+    int x0_send[NUM_DIRECTIONS], y0_send[NUM_DIRECTIONS];
+    int x0_recv[NUM_DIRECTIONS], y0_recv[NUM_DIRECTIONS];
+    int w[NUM_DIRECTIONS], h[NUM_DIRECTIONS];
+    real_t* send_buf[NUM_DIRECTIONS];
+    real_t* recv_buf[NUM_DIRECTIONS];
+    MPI_Request requests[2 * NUM_DIRECTIONS];
+    MPI_Comm comm;
+
+    int mode;
+    MPI_Datatype send_type[NUM_DIRECTIONS], recv_type[NUM_DIRECTIONS];
+    const real_t* bound[2];                         // the two time levels the requests are bound to
+    MPI_Request persistent_requests[2][2 * NUM_DIRECTIONS];
+    MPI_Request* active;                            // requests of the exchange in flight
+    int num_active;
+
+    // Neighborhood collectives: the topology communicator, and for each of its neighbors the
+    // direction and the datatypes of the strips
+    MPI_Comm neighbor_comm;
+    int num_neighbors;
+    MPI_Datatype neighbor_send_type[NUM_DIRECTIONS], neighbor_recv_type[NUM_DIRECTIONS];
+    int neighbor_counts[NUM_DIRECTIONS];
+    MPI_Aint neighbor_displs[NUM_DIRECTIONS];
+} halo_exchange;
+
+// Rank of the process at offset (dx, dy), or MPI_PROC_NULL outside a non-periodic grid
+int neighbor_rank(MPI_Comm comm, int dx, int dy) {
+    int dims[2], periods[2], coords[2];
+    MPI_Cart_get(comm, 2, dims, periods, coords);
+    int c[2] = { coords[0] + dx, coords[1] + dy };
+    for (int d = 0; d < 2; d++) {
+        if (c[d] < 0 || c[d] >= dims[d]) {
+            if (!periods[d]) return MPI_PROC_NULL;
+            c[d] = (c[d] + dims[d]) % dims[d];
+        }
+    }
+    int r;
+    MPI_Cart_rank(comm, c, &r);
+    return r;
+}
+
+// Offset and extent of the strip of width `ghost` along one axis:
+// -1 is the low side, 0 the whole owned range, +1 the high side
+void strip(int d, int n, int ghost, int* send0, int* recv0, int* len) {
+    if (d < 0) { *send0 = 0; *recv0 = -ghost; *len = ghost; }
+    else if (d > 0) { *send0 = n - ghost; *recv0 = n; *len = ghost; }
+    else { *send0 = 0; *recv0 = 0; *len = n; }
+}
+
+// Datatype selecting the rectangle [x0, x0 + w) x [y0, y0 + h) of the padded grid
+MPI_Datatype strip_type(const grid_layout* g, int x0, int y0, int w, int h) {
+    int sizes[2] = { g->ny + 2 * g->ghost, g->stride };
+    int subsizes[2] = { h, w };
+    int starts[2] = { y0 + g->ghost, x0 + g->ghost };
+    MPI_Datatype t;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_REAL_T, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+// Communicator and neighbor order for the neighborhood collectives. The Cartesian communicator
+// itself lists the edge neighbors per dimension, low side first; the corners need a distributed
+// graph with all eight neighbors. Sets the direction of every neighbor and returns their number.
+int neighbor_topology(halo_exchange* ex, MPI_Comm* topo_comm, int* dirs) {
+    int n = 0;
+    int ranks[NUM_DIRECTIONS], weights[NUM_DIRECTIONS];
+    for (int d = 0; d < NUM_DIRECTIONS; d++) {
+        ranks[d] = MPI_PROC_NULL;
+        weights[d] = 1;
+    }
+    if (ex->num_dirs > 4) {
+        for (int d = 0; d < ex->num_dirs; d++) {
+            if (ex->neighbor[d] == MPI_PROC_NULL) continue;
+            dirs[n] = d;
+            ranks[n++] = ex->neighbor[d];
+        }
+    }
+    // Without corners, or without any neighbor, the Cartesian communicator itself serves; its
+    // absent neighbors are MPI_PROC_NULL and transfer nothing
+    if (n == 0) {
+        dirs[0] = LEFT;
+        dirs[1] = RIGHT;
+        dirs[2] = DOWN;
+        dirs[3] = UP;
+        *topo_comm = ex->comm;
+        return 4;
+    }
+    // Unit weights instead of MPI_UNWEIGHTED: the sentinel pointer trips GCC's
+    // -Wstringop-overread on the array parameters of the prototype
+    MPI_Dist_graph_create_adjacent(ex->comm, n, ranks, weights, n, ranks, weights,
+                                   MPI_INFO_NULL, 0, topo_comm);
+    return n;
+}
+
+// Set up the exchange with the backend `mode` for the time levels T_a and T_b, which are swapped
+// after every step. The corners of the ghost ring are exchanged for rings wider than one cell
+// or if `corners` is set.
+void halo_init(halo_exchange* ex, const grid_layout* g, MPI_Comm comm, int mode, int corners,
+               real_t* T_a, real_t* T_b) {
+    ex->comm = comm;
+    ex->num_dirs = g->ghost > 1 || corners ? NUM_DIRECTIONS : 4;
+    ex->mode = mode;
+    ex->active = ex->requests;
+    ex->num_active = 0;
+    ex->neighbor_comm = MPI_COMM_NULL;
+    ex->num_neighbors = 0;
+    for (int d = 0; d < NUM_DIRECTIONS; d++) {
+        ex->neighbor[d] = d < ex->num_dirs ? neighbor_rank(comm, dir_dx[d], dir_dy[d]) : MPI_PROC_NULL;
+        strip(dir_dx[d], g->nx, g->ghost, &ex->x0_send[d], &ex->x0_recv[d], &ex->w[d]);
+        strip(dir_dy[d], g->ny, g->ghost, &ex->y0_send[d], &ex->y0_recv[d], &ex->h[d]);
+        ex->send_buf[d] = NULL;
+        ex->recv_buf[d] = NULL;
+        if (mode == HALO_P2P) {
+            ex->send_buf[d] = (real_t*)malloc(sizeof(real_t) * ex->w[d] * ex->h[d]);
+            ex->recv_buf[d] = (real_t*)malloc(sizeof(real_t) * ex->w[d] * ex->h[d]);
+        }
+    }
+    if (mode == HALO_P2P) return;
+
+    for (int d = 0; d < ex->num_dirs; d++) {
+        ex->send_type[d] = strip_type(g, ex->x0_send[d], ex->y0_send[d], ex->w[d], ex->h[d]);
+        ex->recv_type[d] = strip_type(g, ex->x0_recv[d], ex->y0_recv[d], ex->w[d], ex->h[d]);
+    }
+    if (mode == HALO_NEIGHBOR || mode == HALO_INEIGHBOR) {
+        // The datatypes address the strips relative to the start of the grid, so all
+        // displacements are zero and the same grid is passed as send and receive buffer
+        int dirs[NUM_DIRECTIONS];
+        ex->num_neighbors = neighbor_topology(ex, &ex->neighbor_comm, dirs);
+        for (int n = 0; n < ex->num_neighbors; n++) {
+            ex->neighbor_send_type[n] = ex->send_type[dirs[n]];
+            ex->neighbor_recv_type[n] = ex->recv_type[dirs[n]];
+            ex->neighbor_counts[n] = 1;
+            ex->neighbor_displs[n] = 0;
+        }
+        return;
+    }
+
+    ex->bound[0] = T_a;
+    ex->bound[1] = T_b;
+    for (int s = 0; s < 2; s++) {
+        real_t* T = s == 0 ? T_a : T_b;
+        for (int d = 0; d < ex->num_dirs; d++) {
+            MPI_Recv_init(T, 1, ex->recv_type[d], ex->neighbor[d], dir_opposite[d], comm,
+                          &ex->persistent_requests[s][d]);
+            MPI_Send_init(T, 1, ex->send_type[d], ex->neighbor[d], d, comm,
+                          &ex->persistent_requests[s][ex->num_dirs + d]);
+        }
+    }
+}
+
+void halo_free(halo_exchange* ex) {
+    for (int d = 0; d < NUM_DIRECTIONS; d++) {
+        free(ex->send_buf[d]);
+        free(ex->recv_buf[d]);
+    }
+    if (ex->mode == HALO_P2P) return;
+    for (int d = 0; d < ex->num_dirs; d++) {
+        MPI_Type_free(&ex->send_type[d]);
+        MPI_Type_free(&ex->recv_type[d]);
+    }
+    if (ex->neighbor_comm != MPI_COMM_NULL && ex->neighbor_comm != ex->comm)
+        MPI_Comm_free(&ex->neighbor_comm);
+    if (ex->mode != HALO_PERSISTENT) return;
+    for (int s = 0; s < 2; s++)
+        for (int r = 0; r < 2 * ex->num_dirs; r++)
+            MPI_Request_free(&ex->persistent_requests[s][r]);
+}
+
+// Post the non-blocking exchange of the owned border strips
+void halo_start(halo_exchange* ex, const real_t* T, const grid_layout* g) {
+    if (ex->mode == HALO_PERSISTENT) {
+        ex->active = ex->persistent_requests[T == ex->bound[0] ? 0 : 1];
+        ex->num_active = 2 * ex->num_dirs;
+        MPI_Startall(ex->num_active, ex->active);
+        return;
+    }
+    if (ex->mode == HALO_NEIGHBOR || ex->mode == HALO_INEIGHBOR) {
+        // The halo is received into the ghost ring of the grid the strips are sent from
+        real_t* buf = (real_t*)T;
+        ex->active = ex->requests;
+        ex->num_active = 0;
+        if (ex->mode == HALO_NEIGHBOR) {
+            MPI_Neighbor_alltoallw(buf, ex->neighbor_counts, ex->neighbor_displs, ex->neighbor_send_type,
+                                   buf, ex->neighbor_counts, ex->neighbor_displs, ex->neighbor_recv_type,
+                                   ex->neighbor_comm);
+        } else {
+            MPI_Ineighbor_alltoallw(buf, ex->neighbor_counts, ex->neighbor_displs, ex->neighbor_send_type,
+                                    buf, ex->neighbor_counts, ex->neighbor_displs, ex->neighbor_recv_type,
+                                    ex->neighbor_comm, &ex->requests[0]);
+            ex->num_active = 1;
+        }
+        return;
+    }
+    ex->active = ex->requests;
+    ex->num_active = 2 * ex->num_dirs;
+    for (int d = 0; d < ex->num_dirs; d++) {
+        // Messages are tagged with the direction they are sent towards, so the strip
+        // arriving from direction d carries the tag of the opposite direction
+        MPI_Irecv(ex->recv_buf[d], ex->w[d] * ex->h[d], MPI_REAL_T, ex->neighbor[d],
+                  dir_opposite[d], ex->comm, &ex->requests[d]);
+    }
+    for (int d = 0; d < ex->num_dirs; d++) {
+        pack_block(T, g, ex->x0_send[d], ex->y0_send[d], ex->w[d], ex->h[d], ex->send_buf[d]);
+        MPI_Isend(ex->send_buf[d], ex->w[d] * ex->h[d], MPI_REAL_T, ex->neighbor[d],
+                  d, ex->comm, &ex->requests[ex->num_dirs + d]);
+    }
+}
+
+// Mirror the owned border into the ghost ring on the sides without a neighbor, so that no
+// heat flows across the border of the global grid. The y sides are mirrored over the whole
+// padded width first, so the corners are correct for every combination of neighbors.
+void apply_boundary(real_t* T, const grid_layout* g, const halo_exchange* ex) {
+    int G = g->ghost;
+    for (int j = 0; j < G; j++) {
+        for (int x = -G; x < g->nx + G; x++) {
+            if (ex->neighbor[DOWN] == MPI_PROC_NULL)
+                T[idx(g, x, -1 - j)] = T[idx(g, x, j < g->ny ? j : g->ny - 1)];
+            if (ex->neighbor[UP] == MPI_PROC_NULL)
+                T[idx(g, x, g->ny + j)] = T[idx(g, x, g->ny - 1 - j >= 0 ? g->ny - 1 - j : 0)];
+        }
+    }
+    for (int y = -G; y < g->ny + G; y++) {
+        for (int j = 0; j < G; j++) {
+            if (ex->neighbor[LEFT] == MPI_PROC_NULL)
+                T[idx(g, -1 - j, y)] = T[idx(g, j < g->nx ? j : g->nx - 1, y)];
+            if (ex->neighbor[RIGHT] == MPI_PROC_NULL)
+                T[idx(g, g->nx + j, y)] = T[idx(g, g->nx - 1 - j >= 0 ? g->nx - 1 - j : 0, y)];
+        }
+    }
+}
+
+// Wait for the exchange, then fill the ghost ring from the received strips and the boundary condition
+void halo_finish(halo_exchange* ex, real_t* T, const grid_layout* g) {
+    MPI_Waitall(ex->num_active, ex->active, MPI_STATUSES_IGNORE);
+    for (int d = 0; d < ex->num_dirs && ex->mode == HALO_P2P; d++) {
+        if (ex->neighbor[d] != MPI_PROC_NULL)
+            unpack_block(T, g, ex->x0_recv[d], ex->y0_recv[d], ex->w[d], ex->h[d], ex->recv_buf[d]);
+    }
+    apply_boundary(T, g, ex);
+}
+
+// Update n cells of one row. c points to the first cell, down and up to the cells below and
+// above it; c[-1] and c[n] must be readable. The loop has no branches and no index arithmetic
+// besides the unit stride, so it vectorizes. The sum is evaluated in acc_t, so the float
+// kernel stays in single precision and the mixed kernel widens the loads to double.
+SIMD_CLONES
+void stencil_row_simd(const real_t* restrict c, const real_t* restrict down, const real_t* restrict up,
+                      real_t* restrict out, int n, acc_t conductivity, acc_t delta_t) {
+    for (int x = 0; x < n; x++) {
+        acc_t dTdt = conductivity * (-4 * (acc_t)c[x] + c[x - 1] + c[x + 1] + down[x] + up[x]);
+        out[x] = (real_t)(c[x] + delta_t * dTdt);
+    }
+}
+
+// Scalar reference kernel with the same interface
+void stencil_row_scalar(const real_t* c, const real_t* down, const real_t* up,
+                        real_t* out, int n, acc_t conductivity, acc_t delta_t) {
+    for (int x = 0; x < n; x++) {
+        int i_left = x - 1;
+        int i_right = x + 1;
+        acc_t dTdt = conductivity * (-4 * (acc_t)c[x] + c[i_left] + c[i_right] + down[x] + up[x]);
+        out[x] = (real_t)(c[x] + delta_t * dTdt);
+    }
+}
+
+typedef void (*stencil_row_fn)(const real_t*, const real_t*, const real_t*, real_t*, int, acc_t, acc_t);
+stencil_row_fn stencil_row = stencil_row_simd;
+
+const char* stencil_kernel_name(void) {
+    if (stencil_row == stencil_row_scalar) return "scalar";
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) return "avx512f";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+    return "default";
+}
+
+// Update the cells in [x0, x1) x [y0, y1) with the explicit 5-point stencil
+void compute_rect(const real_t* T_k, real_t* T_kn, const grid_layout* g, int x0, int x1, int y0, int y1,
+                  double conductivity, double delta_t) {
+    if (x1 <= x0) return;
+    #pragma omp parallel for schedule(static) if ((y1 - y0) * (x1 - x0) >= 4096)
+    for (int y = y0; y < y1; y++) {
+        int i = idx(g, x0, y);
+        stencil_row(T_k + i, T_k + i - g->stride, T_k + i + g->stride, T_kn + i, x1 - x0,
+                    conductivity, delta_t);
+    }
+}
+
+// Update the cells which do not depend on the ghost ring
+void compute_interior(const real_t* T_k, real_t* T_kn, const grid_layout* g,
+                      double conductivity, double delta_t) {
+    compute_rect(T_k, T_kn, g, 1, g->nx - 1, 1, g->ny - 1, conductivity, delta_t);
+}
+
+// Update the outermost rows and columns of the block, which need the ghost ring
+void compute_boundary(const real_t* T_k, real_t* T_kn, const grid_layout* g,
+                      double conductivity, double delta_t) {
+    compute_rect(T_k, T_kn, g, 0, g->nx, 0, 1, conductivity, delta_t);
+    if (g->ny > 1)
+        compute_rect(T_k, T_kn, g, 0, g->nx, g->ny - 1, g->ny, conductivity, delta_t);
+    compute_rect(T_k, T_kn, g, 0, 1, 1, g->ny - 1, conductivity, delta_t);
+    if (g->nx > 1)
+        compute_rect(T_k, T_kn, g, g->nx - 1, g->nx, 1, g->ny - 1, conductivity, delta_t);
+}
+
+// Advance the tile [tx0, tx1) x [ty0, ty1) by `steps` time steps, reading T_k and writing the
+// final values of the tile into T_kn. The ghost ring of T_k must be at least `steps` wide. The
+// intermediate levels of the tile and of its shrinking overlap region, which is recomputed
+// redundantly instead of exchanged, live in two scratch buffers small enough to stay in cache.
+void compute_tile(const real_t* T_k, real_t* T_kn, const grid_layout* g, int tx0, int tx1, int ty0, int ty1,
+                  int steps, real_t* scratch_a, real_t* scratch_b, double conductivity, double delta_t) {
+    grid_layout t = make_layout(tx1 - tx0, ty1 - ty0, steps);
+    const real_t* src = T_k;
+    const grid_layout* src_layout = g;
+    int src_x0 = 0, src_y0 = 0;
+    for (int s = 0; s < steps; s++) {
+        // Width of the overlap region which is still needed after this step
+        int e = steps - 1 - s;
+        real_t* dst = T_kn;
+        const grid_layout* dst_layout = g;
+        int dst_x0 = 0, dst_y0 = 0;
+        if (e > 0) {
+            dst = s % 2 == 0 ? scratch_a : scratch_b;
+            dst_layout = &t;
+            dst_x0 = tx0;
+            dst_y0 = ty0;
+        }
+        for (int y = ty0 - e; y < ty1 + e; y++) {
+            const real_t* c = src + idx(src_layout, tx0 - e - src_x0, y - src_y0);
+            stencil_row(c, c - src_layout->stride, c + src_layout->stride,
+                        dst + idx(dst_layout, tx0 - e - dst_x0, y - dst_y0), tx1 - tx0 + 2 * e,
+                        conductivity, delta_t);
+        }
+        src = dst;
+        src_layout = dst_layout;
+        src_x0 = dst_x0;
+        src_y0 = dst_y0;
+    }
+}
+
+// Which tiles compute_tiles updates: tiles whose overlap region lies inside the owned cells do
+// not depend on the ghost ring and can be computed while the halos are in flight
+enum { TILES_ALL, TILES_INTERIOR, TILES_BOUNDARY };
+
+// The tiles are distributed over the threads, each thread uses its own pair of scratch buffers
+void compute_tiles(const real_t* T_k, real_t* T_kn, const grid_layout* g, int tile, int steps, int which,
+                   real_t** scratch_a, real_t** scratch_b, double conductivity, double delta_t) {
+    int tiles_x = (g->nx + tile - 1) / tile;
+    int tiles_y = (g->ny + tile - 1) / tile;
+    #pragma omp parallel for schedule(static)
+    for (int t = 0; t < tiles_x * tiles_y; t++) {
+        int tx0 = (t % tiles_x) * tile;
+        int ty0 = (t / tiles_x) * tile;
+        int tx1 = tx0 + tile < g->nx ? tx0 + tile : g->nx;
+        int ty1 = ty0 + tile < g->ny ? ty0 + tile : g->ny;
+        int interior = tx0 - steps >= 0 && tx1 + steps <= g->nx && ty0 - steps >= 0 && ty1 + steps <= g->ny;
+        if ((which == TILES_INTERIOR && !interior) || (which == TILES_BOUNDARY && interior))
+            continue;
+        int thread = omp_get_thread_num();
+        compute_tile(T_k, T_kn, g, tx0, tx1, ty0, ty1, steps, scratch_a[thread], scratch_b[thread],
+                     conductivity, delta_t);
+    }
+}
+
+// Checkpoint files start with a header of CHECKPOINT_HEADER_SIZE bytes, followed by the global
+// grid as real_t values in row-major order (grid_size_y rows of grid_size_x cells). The file does
+// not depend on the process grid, so a run can be restarted with a different number of processes,
+// but only with the element type it was written with.
+#define CHECKPOINT_HEADER_SIZE 64
+#define CHECKPOINT_MAGIC "HEAT2D01"
+
+typedef struct {
+    char magic[8];
+    long long grid_size_x, grid_size_y;
+    long long step;
+    long long element_size;     // sizeof(real_t); 0 in files written before it was recorded (double)
+} checkpoint_header;
+
+// Set the file view of fh to the block of nx x ny cells at (x0, y0) of the global grid
+void set_block_view(MPI_File fh, int grid_size_x, int grid_size_y, int x0, int y0, int nx, int ny) {
+    int sizes[2] = { grid_size_y, grid_size_x };
+    int subsizes[2] = { ny, nx };
+    int starts[2] = { y0, x0 };
+    MPI_Datatype filetype;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_REAL_T, &filetype);
+    MPI_Type_commit(&filetype);
+    MPI_File_set_view(fh, CHECKPOINT_HEADER_SIZE, MPI_REAL_T, filetype, "native", MPI_INFO_NULL);
+    MPI_Type_free(&filetype);
+}
+
+// Collectively write the owned cells of every process into one shared file. The file is
+// written under a temporary name and renamed when complete, so a crash during the write
+// leaves the previous checkpoint intact.
+void checkpoint_write(const char* path, const real_t* T, const grid_layout* g, int grid_size_x, int grid_size_y,
+                      int x0, int y0, int step, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    MPI_File fh;
+    if (MPI_File_open(comm, tmp_path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (rank == 0)
+            fprintf(stderr, "Failed to open checkpoint file %s\n", tmp_path);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+    if (rank == 0) {
+        checkpoint_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.grid_size_x = grid_size_x;
+        header.grid_size_y = grid_size_y;
+        header.step = step;
+        header.element_size = sizeof(real_t);
+        MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    MPI_Datatype owned = strip_type(g, 0, 0, g->nx, g->ny);
+    set_block_view(fh, grid_size_x, grid_size_y, x0, y0, g->nx, g->ny);
+    MPI_File_write_all(fh, T, 1, owned, MPI_STATUS_IGNORE);
+    MPI_Type_free(&owned);
+    MPI_File_close(&fh);
+
+    if (rank == 0 && rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s\n", tmp_path, path);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+}
+
+// Collectively read the owned cells of every process from a checkpoint file and return the
+// time step it was written at
+int checkpoint_read(const char* path, real_t* T, const grid_layout* g, int grid_size_x, int grid_size_y,
+                    int x0, int y0, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    MPI_File fh;
+    if (MPI_File_open(comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (rank == 0)
+            fprintf(stderr, "Failed to open checkpoint file %s\n", path);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+    checkpoint_header header;
+    MPI_File_read_at_all(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.grid_size_x != grid_size_x || header.grid_size_y != grid_size_y) {
+        if (rank == 0)
+            fprintf(stderr, "Checkpoint %s does not match a %d x %d grid\n", path, grid_size_x, grid_size_y);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+    long long element_size = header.element_size != 0 ? header.element_size : (long long)sizeof(double);
+    if (element_size != (long long)sizeof(real_t)) {
+        if (rank == 0)
+            fprintf(stderr, "Checkpoint %s was written with %lld-byte elements, this build uses %s\n",
+                    path, element_size, PRECISION_NAME);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+
+    MPI_Datatype owned = strip_type(g, 0, 0, g->nx, g->ny);
+    set_block_view(fh, grid_size_x, grid_size_y, x0, y0, g->nx, g->ny);
+    MPI_File_read_all(fh, T, 1, owned, MPI_STATUS_IGNORE);
+    MPI_Type_free(&owned);
+    MPI_File_close(&fh);
+    return (int)header.step;
+}
+
+// Diagnostics of the owned cells, reduced over all processes in a single MPI_Allreduce
+field_stats compute_field_stats(const real_t* T, const grid_layout* g, MPI_Comm comm) {
+    double sum = 0.0, sum_sq = 0.0, min = INFINITY, max = -INFINITY;
+    #pragma omp parallel for schedule(static) reduction(+:sum, sum_sq) reduction(min:min) reduction(max:max)
+    for (int y = 0; y < g->ny; y++) {
+        for (int x = 0; x < g->nx; x++) {
+            double v = T[idx(g, x, y)];
+            sum += v;
+            sum_sq += v * v;
+            if (v < min) min = v;
+            if (v > max) max = v;
+        }
+    }
+    field_stats local = { sum, sum_sq, min, max };
+    return field_stats_allreduce(local, comm);
+}
+
+// Largest change of an owned cell between two time levels, divided by the number of steps
+// between them
+double local_residual(const real_t* T_new, const real_t* T_old, const grid_layout* g, int steps) {
+    double residual = 0.0;
+    #pragma omp parallel for schedule(static) reduction(max:residual)
+    for (int y = 0; y < g->ny; y++) {
+        for (int x = 0; x < g->nx; x++) {
+            double d = fabs(T_new[idx(g, x, y)] - T_old[idx(g, x, y)]);
+            if (d > residual) residual = d;
+        }
+    }
+    return residual / steps;
+}
+
+// Number of steps from step k to the next multiple of `every`
+int steps_to_multiple(int k, int every) {
+    return every - k % every;
+}
+
+// Implicit solver backends. A backward Euler step solves (I - a L) T_kn = T_k with
+// a = conductivity * delta_t and L the 5-point Laplacian, which allows time steps far beyond
+// the stability limit of the explicit update.
+enum { SOLVER_EXPLICIT, SOLVER_RBGS, SOLVER_MULTIGRID };
+
+// One level of the multigrid hierarchy; the finest level is also used by the red-black solver
+typedef struct mg_level {
+    grid_layout g;
+    int x0, y0;         // global offset of the block on this level
+    double a;           // coupling of the operator rediscretized on this level
+    real_t* x;          // solution, or correction on the coarse levels
+    real_t* b;          // right-hand side
+    real_t* r;          // residual
+    halo_exchange ex;
+
+    // Coarsest level of a hierarchy over several processes: the blocks are gathered onto rank 0,
+    // which continues with a serial hierarchy of the whole coarse grid (see coarse_solve)
+    int agglomerate;
+    real_t* packed;             // the owned block, contiguous
+    struct mg_level* serial;    // levels of the serial hierarchy, rank 0 only
+    int num_serial;
+    int* blocks;                // x0, y0, nx, ny of the block of every process, rank 0 only
+    int* counts;                // cells of every block and their offsets in gathered, rank 0 only
+    int* displs;
+    real_t* gathered;           // blocks of all processes, rank 0 only
+    MPI_Comm self_comm;         // 1 x 1 Cartesian communicator of the serial hierarchy
+} mg_level;
+
+// Red-black SOR update of the cells of one color, (x0 + x + y0 + y) % 2 == color.
+// The ghost ring of x must be up to date.
+void rb_sweep(mg_level* L, int color, double omega) {
+    const grid_layout* g = &L->g;
+    acc_t a = L->a;
+    acc_t inv_diag = 1.0 / (1.0 + 4.0 * a);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < g->ny; y++) {
+        int first = (color + L->x0 + L->y0 + y) & 1;
+        real_t* v = L->x + idx(g, 0, y);
+        const real_t* rhs = L->b + idx(g, 0, y);
+        for (int i = first; i < g->nx; i += 2) {
+            acc_t gs = (rhs[i] + a * ((acc_t)v[i - 1] + v[i + 1] + v[i - g->stride] + v[i + g->stride])) * inv_diag;
+            v[i] = (real_t)(v[i] + omega * (gs - v[i]));
+        }
+    }
+}
+
+void smooth(mg_level* L, int sweeps, double omega) {
+    for (int s = 0; s < sweeps; s++) {
+        for (int color = 0; color < 2; color++) {
+            halo_start(&L->ex, L->x, &L->g);
+            halo_finish(&L->ex, L->x, &L->g);
+            rb_sweep(L, color, omega);
+        }
+    }
+}
+
+// r = b - A x on the owned cells; returns the largest local |r|
+double compute_residual(mg_level* L) {
+    const grid_layout* g = &L->g;
+    halo_start(&L->ex, L->x, g);
+    halo_finish(&L->ex, L->x, g);
+    acc_t a = L->a;
+    double max_r = 0.0;
+    #pragma omp parallel for schedule(static) reduction(max:max_r)
+    for (int y = 0; y < g->ny; y++) {
+        for (int x = 0; x < g->nx; x++) {
+            int i = idx(g, x, y);
+            const real_t* v = L->x;
+            acc_t r = L->b[i] - ((1 + 4 * a) * v[i] - a * ((acc_t)v[i - 1] + v[i + 1] + v[i - g->stride] + v[i + g->stride]));
+            L->r[i] = (real_t)r;
+            if (fabs(r) > max_r) max_r = fabs(r);
+        }
+    }
+    return max_r;
+}
+
+// Coarse right-hand side: average of the residual of the 2 x 2 fine cells; zero initial correction.
+// Coarse cell X covers the global fine cells 2X and 2X + 1, so a pair may straddle two blocks
+// and the ghost ring of the residual is exchanged first. On a grid of odd size the last coarse
+// cell sticks out of the domain by one fine cell. That cell is skipped (the w and h checks), so
+// it counts as zero residual and the sum is still scaled by 1/4; the mirrored ghost is not read.
+void restrict_residual(mg_level* f, mg_level* c) {
+    halo_start(&f->ex, f->r, &f->g);
+    halo_finish(&f->ex, f->r, &f->g);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < c->g.ny; y++) {
+        int fy = 2 * (c->y0 + y) - f->y0;
+        int h = fy + 1 < f->g.ny || f->ex.neighbor[UP] != MPI_PROC_NULL ? 2 : 1;
+        for (int x = 0; x < c->g.nx; x++) {
+            int fx = 2 * (c->x0 + x) - f->x0;
+            int w = fx + 1 < f->g.nx || f->ex.neighbor[RIGHT] != MPI_PROC_NULL ? 2 : 1;
+            int i = idx(&f->g, fx, fy);
+            acc_t sum = f->r[i];
+            if (w == 2) sum += f->r[i + 1];
+            if (h == 2) sum += f->r[i + f->g.stride];
+            if (w == 2 && h == 2) sum += f->r[i + f->g.stride + 1];
+            c->b[idx(&c->g, x, y)] = (real_t)((acc_t)0.25 * sum);
+            c->x[idx(&c->g, x, y)] = 0.0;
+        }
+    }
+}
+
+// Add the bilinearly interpolated coarse correction to the fine solution. The coarse cell of a
+// fine cell at the low edge of a block may belong to the neighbor and is read from the ghost ring.
+void prolongate_add(mg_level* c, mg_level* f) {
+    halo_start(&c->ex, c->x, &c->g);
+    halo_finish(&c->ex, c->x, &c->g);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < f->g.ny; y++) {
+        int gy = f->y0 + y;
+        int cy = gy / 2 - c->y0;
+        int sy = (gy & 1) ? 1 : -1;
+        for (int x = 0; x < f->g.nx; x++) {
+            int gx = f->x0 + x;
+            int cx = gx / 2 - c->x0;
+            int sx = (gx & 1) ? 1 : -1;
+            acc_t e = (acc_t)0.5625 * c->x[idx(&c->g, cx, cy)]
+                    + (acc_t)0.1875 * ((acc_t)c->x[idx(&c->g, cx + sx, cy)] + c->x[idx(&c->g, cx, cy + sy)])
+                    + (acc_t)0.0625 * c->x[idx(&c->g, cx + sx, cy + sy)];
+            f->x[idx(&f->g, x, y)] = (real_t)(f->x[idx(&f->g, x, y)] + e);
+        }
+    }
+}
+
+void v_cycle(mg_level* levels, int l, int num_levels);
+
+// Solve on the coarsest level. Without agglomeration, a fixed number of sweeps of the blocks.
+// With agglomeration, the right-hand side is gathered onto rank 0, which runs a V-cycle of the
+// serial hierarchy down to a grid of a few cells, and the correction is scattered back, so the
+// depth and accuracy of the coarse solve do not depend on the number of processes.
+void coarse_solve(mg_level* L) {
+    if (!L->agglomerate) {
+        smooth(L, 20, 1.0);
+        return;
+    }
+    int n = L->g.nx * L->g.ny;
+    pack_block(L->b, &L->g, 0, 0, L->g.nx, L->g.ny, L->packed);
+    MPI_Gatherv(L->packed, n, MPI_REAL_T, L->gathered, L->counts, L->displs, MPI_REAL_T, 0, L->ex.comm);
+    if (L->serial != NULL) {
+        mg_level* S = &L->serial[0];
+        int size;
+        MPI_Comm_size(L->ex.comm, &size);
+        for (int r = 0; r < size; r++) {
+            const int* B = L->blocks + 4 * r;
+            unpack_block(S->b, &S->g, B[0], B[1], B[2], B[3], L->gathered + L->displs[r]);
+        }
+        memset(S->x, 0, sizeof(real_t) * S->g.size);
+        v_cycle(L->serial, 0, L->num_serial);
+        for (int r = 0; r < size; r++) {
+            const int* B = L->blocks + 4 * r;
+            pack_block(S->x, &S->g, B[0], B[1], B[2], B[3], L->gathered + L->displs[r]);
+        }
+    }
+    MPI_Scatterv(L->gathered, L->counts, L->displs, MPI_REAL_T, L->packed, n, MPI_REAL_T, 0, L->ex.comm);
+    unpack_block(L->x, &L->g, 0, 0, L->g.nx, L->g.ny, L->packed);
+}
+
+void v_cycle(mg_level* levels, int l, int num_levels) {
+    mg_level* L = &levels[l];
+    if (l == num_levels - 1) {
+        coarse_solve(L);
+        return;
+    }
+    smooth(L, 2, 1.0);
+    compute_residual(L);
+    restrict_residual(L, &levels[l + 1]);
+    v_cycle(levels, l + 1, num_levels);
+    prolongate_add(&levels[l + 1], L);
+    smooth(L, 2, 1.0);
+}
+
+// Coarse block of the fine block [x0, x0 + n): the coarse cells X with 2X inside the block,
+// ceil(n / 2) or floor(n / 2) of them depending on the parity of x0
+void coarse_range(int x0, int n, int* coarse_x0, int* coarse_n) {
+    *coarse_x0 = (x0 + 1) / 2;
+    *coarse_n = (x0 + n + 1) / 2 - *coarse_x0;
+}
+
+// Build the level hierarchy by cell-centred coarsening: coarse cell X covers the global fine
+// cells 2X and 2X + 1, and belongs to the process owning cell 2X. Works for blocks of any size
+// and offset, as from the uneven split of odd grids; coarsening stops before a block gets
+// narrower than two cells. On several processes the coarsest level is then agglomerated onto
+// rank 0 if the whole coarse grid can still be coarsened there.
+int mg_init(mg_level* levels, int max_levels, int nx, int ny, int x0, int y0, double a, MPI_Comm comm) {
+    int local_levels = 1;
+    for (int w = nx, h = ny, bx = x0, by = y0; local_levels < max_levels && w >= 4 && h >= 4; local_levels++) {
+        coarse_range(bx, w, &bx, &w);
+        coarse_range(by, h, &by, &h);
+    }
+    int num_levels;
+    MPI_Allreduce(&local_levels, &num_levels, 1, MPI_INT, MPI_MIN, comm);
+
+    for (int l = 0; l < num_levels; l++) {
+        mg_level* L = &levels[l];
+        if (l == 0) {
+            L->x0 = x0;
+            L->y0 = y0;
+            L->g = make_layout(nx, ny, 1);
+        } else {
+            int w, h;
+            coarse_range(levels[l - 1].x0, levels[l - 1].g.nx, &L->x0, &w);
+            coarse_range(levels[l - 1].y0, levels[l - 1].g.ny, &L->y0, &h);
+            L->g = make_layout(w, h, 1);
+        }
+        // The stencil is divided by the squared mesh width, which doubles on every level
+        L->a = a / (double)(1 << (2 * l));
+        L->x = grid_alloc(&L->g);
+        L->b = grid_alloc(&L->g);
+        L->r = grid_alloc(&L->g);
+        halo_init(&L->ex, &L->g, comm, HALO_P2P, 1, NULL, NULL);
+        L->agglomerate = 0;
+        L->packed = NULL;
+        L->serial = NULL;
+        L->num_serial = 0;
+        L->blocks = L->counts = L->displs = NULL;
+        L->gathered = NULL;
+        L->self_comm = MPI_COMM_NULL;
+    }
+
+    // Size of the whole coarsest grid
+    mg_level* C = &levels[num_levels - 1];
+    int rank, size, extent[2] = { C->x0 + C->g.nx, C->y0 + C->g.ny };
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Allreduce(MPI_IN_PLACE, extent, 2, MPI_INT, MPI_MAX, comm);
+    if (max_levels < 2 || size == 1 || extent[0] < 4 || extent[1] < 4)
+        return num_levels;
+
+    C->agglomerate = 1;
+    C->packed = (real_t*)malloc(sizeof(real_t) * C->g.nx * C->g.ny);
+    int block[4] = { C->x0, C->y0, C->g.nx, C->g.ny };
+    if (rank == 0)
+        C->blocks = (int*)malloc(sizeof(int) * 4 * size);
+    MPI_Gather(block, 4, MPI_INT, C->blocks, 4, MPI_INT, 0, comm);
+    if (rank == 0) {
+        C->counts = (int*)malloc(sizeof(int) * size);
+        C->displs = (int*)malloc(sizeof(int) * size);
+        for (int r = 0; r < size; r++) {
+            C->counts[r] = C->blocks[4 * r + 2] * C->blocks[4 * r + 3];
+            C->displs[r] = r == 0 ? 0 : C->displs[r - 1] + C->counts[r - 1];
+        }
+        C->gathered = (real_t*)malloc(sizeof(real_t) * extent[0] * extent[1]);
+        int self_dims[2] = { 1, 1 }, self_periods[2] = { 0, 0 };
+        MPI_Cart_create(MPI_COMM_SELF, 2, self_dims, self_periods, 0, &C->self_comm);
+        C->serial = (mg_level*)malloc(sizeof(mg_level) * max_levels);
+        C->num_serial = mg_init(C->serial, max_levels, extent[0], extent[1], 0, 0, C->a, C->self_comm);
+    }
+    return num_levels;
+}
+
+void mg_free(mg_level* levels, int num_levels) {
+    for (int l = 0; l < num_levels; l++) {
+        mg_level* L = &levels[l];
+        free(L->x);
+        free(L->b);
+        free(L->r);
+        halo_free(&L->ex);
+        if (L->serial != NULL) {
+            mg_free(L->serial, L->num_serial);
+            free(L->serial);
+            MPI_Comm_free(&L->self_comm);
+        }
+        free(L->packed);
+        free(L->blocks);
+        free(L->counts);
+        free(L->displs);
+        free(L->gathered);
+    }
+}
+
+// One backward Euler step from T_k to T_kn. Iterates until the largest residual is below tol or
+// max_iterations are done, and returns the number of iterations.
+int implicit_step(int solver, mg_level* levels, int num_levels, const real_t* T_k, real_t* T_kn,
+                  const grid_layout* g, double omega, double tol, int max_iterations, MPI_Comm comm) {
+    mg_level* L = &levels[0];
+    for (int y = 0; y < g->ny; y++) {
+        memcpy(L->b + idx(&L->g, 0, y), T_k + idx(g, 0, y), sizeof(real_t) * g->nx);
+        memcpy(L->x + idx(&L->g, 0, y), T_k + idx(g, 0, y), sizeof(real_t) * g->nx);
+    }
+    int it = 0;
+    while (it < max_iterations) {
+        if (solver == SOLVER_MULTIGRID)
+            v_cycle(levels, 0, num_levels);
+        else
+            smooth(L, 1, omega);
+        it++;
+        double r_local = compute_residual(L), r_global;
+        MPI_Allreduce(&r_local, &r_global, 1, MPI_DOUBLE, MPI_MAX, comm);
+        if (r_global < tol) break;
+    }
+    for (int y = 0; y < g->ny; y++)
+        memcpy(T_kn + idx(g, 0, y), L->x + idx(&L->g, 0, y), sizeof(real_t) * g->nx);
+    return it;
+}
+
+// Reject a bad command line: rank 0 reports it, then all processes stop. Every process parses
+// the same command line, so all of them get here and the barrier lets rank 0 print first.
+void command_line_error(const char* message, const char* arg) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == 0)
+        fprintf(stderr, "%s: %s\n", message, arg);
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-    MPI_Init(&argc, &argv);
+    // Only the master thread calls MPI, the thread team works on the stencil in between
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    phase_timer timer;
+    phase_timer_init(&timer, 1);
+    phase_begin(&timer, PHASE_INIT);
 
     int rank, size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
     // Simulation parameters
@@ -22,6 +895,96 @@ int main(int argc, char** argv) {
     int num_time_steps = 3000;
     double conductivity = 0.1;
 
+    // Command line options:
+    //   --overlap      compute the interior while the halos are in flight
+    //   --persistent   exchange with persistent requests on pre-committed datatypes
+    //   --exchange B   halo exchange backend: p2p (default), persistent, neighbor
+    //                  (MPI_Neighbor_alltoallw) or ineighbor (MPI_Ineighbor_alltoallw)
+    //   --scalar       use the scalar stencil kernel instead of the vectorized one
+    //   --tile N       cache blocking with N x N tiles
+    //   --tile-steps S time steps advanced per tile and per halo exchange (ghost ring width)
+    //   --threads N    threads per process (default: OMP_NUM_THREADS)
+    //   --nx N --ny N  global grid size
+    //   --steps N      number of time steps
+    //   --checkpoint FILE --checkpoint-every N
+    //                  write the grid collectively to FILE every N time steps
+    //   --restart FILE continue from a checkpoint, possibly written with another process count
+    //   --output FILE  write the final field to FILE (checkpoint format)
+    //   --tol EPS      iterate until the residual drops below EPS (--steps is the maximum)
+    //   --check-every K  steps between the non-blocking residual checks
+    //   --solver S     explicit (default), rbgs (red-black Gauss-Seidel/SOR) or mg (multigrid
+    //                  V-cycles); rbgs and mg take implicit backward Euler steps
+    //   --dt T         time step
+    //   --omega W      SOR relaxation factor of the rbgs solver
+    //   --solver-tol EPS --max-iterations N
+    //                  convergence criterion of the implicit solvers per time step
+    //   --timing FILE  write the per-phase timing report to FILE (JSON for *.json, else CSV,
+    //                  - for stdout)
+    // Unknown options and values stop the program with a message.
+    int overlap = 0;
+    int exchange_mode = HALO_P2P;
+    int tile = 0;
+    int tile_steps = 1;
+    const char* checkpoint_path = NULL;
+    int checkpoint_every = 0;
+    const char* restart_path = NULL;
+    const char* output_path = NULL;
+    double tolerance = 0.0;
+    int check_every = 10;
+    int solver = SOLVER_EXPLICIT;
+    double omega = 1.0;
+    double solver_tol = 1e-6;
+    int max_iterations = 1000;
+    const char* timing_path = NULL;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--overlap") == 0) overlap = 1;
+        else if (strcmp(argv[a], "--persistent") == 0) exchange_mode = HALO_PERSISTENT;
+        else if (strcmp(argv[a], "--exchange") == 0 && a + 1 < argc) {
+            a++;
+            if (strcmp(argv[a], "p2p") == 0) exchange_mode = HALO_P2P;
+            else if (strcmp(argv[a], "persistent") == 0) exchange_mode = HALO_PERSISTENT;
+            else if (strcmp(argv[a], "neighbor") == 0) exchange_mode = HALO_NEIGHBOR;
+            else if (strcmp(argv[a], "ineighbor") == 0) exchange_mode = HALO_INEIGHBOR;
+            else command_line_error("Unknown exchange backend (p2p, persistent, neighbor, ineighbor)", argv[a]);
+        }
+        else if (strcmp(argv[a], "--scalar") == 0) stencil_row = stencil_row_scalar;
+        else if (strcmp(argv[a], "--tile") == 0 && a + 1 < argc) tile = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--tile-steps") == 0 && a + 1 < argc) tile_steps = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) omp_set_num_threads(atoi(argv[++a]));
+        else if (strcmp(argv[a], "--nx") == 0 && a + 1 < argc) grid_size_x = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--ny") == 0 && a + 1 < argc) grid_size_y = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--steps") == 0 && a + 1 < argc) num_time_steps = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc) checkpoint_path = argv[++a];
+        else if (strcmp(argv[a], "--checkpoint-every") == 0 && a + 1 < argc) checkpoint_every = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--restart") == 0 && a + 1 < argc) restart_path = argv[++a];
+        else if (strcmp(argv[a], "--output") == 0 && a + 1 < argc) output_path = argv[++a];
+        else if (strcmp(argv[a], "--tol") == 0 && a + 1 < argc) tolerance = atof(argv[++a]);
+        else if (strcmp(argv[a], "--check-every") == 0 && a + 1 < argc) check_every = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--dt") == 0 && a + 1 < argc) delta_t = atof(argv[++a]);
+        else if (strcmp(argv[a], "--omega") == 0 && a + 1 < argc) omega = atof(argv[++a]);
+        else if (strcmp(argv[a], "--solver-tol") == 0 && a + 1 < argc) solver_tol = atof(argv[++a]);
+        else if (strcmp(argv[a], "--max-iterations") == 0 && a + 1 < argc) max_iterations = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--timing") == 0 && a + 1 < argc) timing_path = argv[++a];
+        else if (strcmp(argv[a], "--solver") == 0 && a + 1 < argc) {
+            a++;
+            if (strcmp(argv[a], "explicit") == 0) solver = SOLVER_EXPLICIT;
+            else if (strcmp(argv[a], "rbgs") == 0) solver = SOLVER_RBGS;
+            else if (strcmp(argv[a], "mg") == 0) solver = SOLVER_MULTIGRID;
+            else command_line_error("Unknown solver (explicit, rbgs, mg)", argv[a]);
+        }
+        // Also catches an option given without its value
+        else command_line_error("Unknown option or missing value", argv[a]);
+    }
+    if (checkpoint_path == NULL) checkpoint_every = 0;
+    if (check_every < 1) check_every = 1;
+    // Only time the phases if a report is requested
+    timer.enabled = timing_path != NULL;
+    // The implicit solvers take one time step per solve and exchange inside their iterations
+    if (solver != SOLVER_EXPLICIT) {
+        tile = 0;
+        overlap = 0;
+    }
+
     // Determine the number of processes in each dimension
     int dims[2] = {0, 0}; // Let MPI decide the dimensions
     MPI_Dims_create(size, 2, dims);
@@ -31,94 +994,270 @@ int main(int argc, char** argv) {
     MPI_Comm comm_cart;
     MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &comm_cart);
 
-    // Get the Cartesian coordinates of the current process
+    // Get the Cartesian coordinates of the current process (ranks may be reordered)
     int coords[2];
+    MPI_Comm_rank(comm_cart, &rank);
     MPI_Cart_coords(comm_cart, rank, 2, coords);
+    if (rank == 0) {
+        printf("Stencil kernel: %s, precision: %s\n", stencil_kernel_name(), PRECISION_NAME);
+        printf("Threads per process: %d\n", omp_get_max_threads());
+        if (provided < MPI_THREAD_FUNNELED)
+            printf("Warning: MPI does not provide MPI_THREAD_FUNNELED\n");
+    }
+
+    // Determine the block size and the global offset of the block for each process;
+    // remainders are spread over the processes, so any grid size works with any process grid
+    if (grid_size_x < dims[0] || grid_size_y < dims[1]) {
+        if (rank == 0)
+            fprintf(stderr, "The %d x %d grid is too small for %d x %d processes\n",
+                    grid_size_x, grid_size_y, dims[0], dims[1]);
+        MPI_Abort(comm_cart, EXIT_FAILURE);
+    }
+    int bs_x, bs_y, x0, y0;
+    block_range(grid_size_x, dims[0], coords[0], &x0, &bs_x);
+    block_range(grid_size_y, dims[1], coords[1], &y0, &bs_y);
 
-    // Determine the block size for each process
-    int bs_x = grid_size_x / dims[0];
-    int bs_y = grid_size_y / dims[1];
+    // The ghost ring has to hold the overlap region of all time steps advanced per exchange,
+    // and it is filled from the owned cells of the direct neighbors, so it may not be wider
+    // than the smallest block
+    if (tile <= 0) tile_steps = 1;
+    if (tile_steps < 1) tile_steps = 1;
+    if (tile_steps > grid_size_x / dims[0]) tile_steps = grid_size_x / dims[0];
+    if (tile_steps > grid_size_y / dims[1]) tile_steps = grid_size_y / dims[1];
 
-    // Allocate memory for the local sub-grids
-    double* T_k = (double*)malloc(sizeof(double) * bs_x * bs_y);
-    double* T_kn = (double*)malloc(sizeof(double) * bs_x * bs_y);
+    // Allocate memory for the local sub-grids including the ghost ring
+    grid_layout g = make_layout(bs_x, bs_y, tile_steps);
+    real_t* T_k = grid_alloc(&g);
+    real_t* T_kn = grid_alloc(&g);
+
+    // Scratch buffers for the intermediate time levels of one tile, allocated by the thread using them
+    int num_threads = omp_get_max_threads();
+    real_t** scratch_a = (real_t**)calloc(num_threads, sizeof(real_t*));
+    real_t** scratch_b = (real_t**)calloc(num_threads, sizeof(real_t*));
+    if (tile > 0) {
+        grid_layout t = make_layout(tile, tile, tile_steps);
+        #pragma omp parallel
+        {
+            scratch_a[omp_get_thread_num()] = grid_alloc(&t);
+            scratch_b[omp_get_thread_num()] = grid_alloc(&t);
+        }
+    }
 
     // Initialize the sub-grid with some values
+    #pragma omp parallel for schedule(static)
     for (int y = 0; y < bs_y; y++) {
         for (int x = 0; x < bs_x; x++) {
-            T_k[y * bs_x + x] = x + y + coords[0] * bs_x + coords[1] * bs_y;
-        }
-    }
-
-    // Determine the ranks of neighboring processes
-    int left, right, up, down;
-    MPI_Cart_shift(comm_cart, 0, 1, &left, &right);
-    MPI_Cart_shift(comm_cart, 1, 1, &down, &up);
-
-    // Time-stepping loop
-    for (int k = 0; k < num_time_steps; k++) {
-        // Communicate borders with neighboring processes
-        MPI_Request requests[8];
-        MPI_Isend(T_k, bs_x, MPI_DOUBLE, up, 0, comm_cart, &requests[0]);
-        MPI_Irecv(T_k + bs_y * bs_x, bs_x, MPI_DOUBLE, down, 0, comm_cart, &requests[1]);
-        MPI_Isend(T_k + (bs_y - 1) * bs_x, bs_x, MPI_DOUBLE, down, 0, comm_cart, &requests[2]);
-        MPI_Irecv(T_k - bs_x, bs_x, MPI_DOUBLE, up, 0, comm_cart, &requests[3]);
-
-        // Create derived data type for left and right communication
-        MPI_Datatype column_type;
-        MPI_Type_vector(bs_y, 1, bs_x, MPI_DOUBLE, &column_type);
-        MPI_Type_commit(&column_type);
-
-        MPI_Isend(T_k, 1, column_type, left, 0, comm_cart, &requests[4]);
-        MPI_Irecv(T_k + bs_x - 1, 1, column_type, right, 0, comm_cart, &requests[5]);
-        MPI_Isend(T_k + bs_x - 1, 1, column_type, right, 0, comm_cart, &requests[6]);
-        MPI_Irecv(T_k, 1, column_type, left, 0, comm_cart, &requests[7]);
-
-        MPI_Waitall(8, requests, MPI_STATUSES_IGNORE);
-        MPI_Type_free(&column_type);
-
-        // Compute the heat equation for the local sub-grid
-        for (int y = 1; y < bs_y - 1; y++) {
-            for (int x = 1; x < bs_x - 1; x++) {
-                int i = y * bs_x + x;
-                int i_left = i - 1;
-                int i_right = i + 1;
-                int i_down = i - bs_x;
-                int i_up = i + bs_x;
-
-                double dTdt_i = conductivity * (-4 * T_k[i] +
-                    T_k[i_left] + T_k[i_right] + T_k[i_down] + T_k[i_up]);
-                T_kn[i] = T_k[i] + delta_t * dTdt_i;
+            T_k[idx(&g, x, y)] = x0 + x + y0 + y;
+        }
+    }
+
+    int first_step = 0;
+    if (restart_path != NULL) {
+        phase_end(&timer, PHASE_INIT);
+        phase_begin(&timer, PHASE_IO);
+        first_step = checkpoint_read(restart_path, T_k, &g, grid_size_x, grid_size_y,
+                                     x0, y0, comm_cart);
+        phase_end(&timer, PHASE_IO);
+        phase_begin(&timer, PHASE_INIT);
+        if (rank == 0)
+            printf("Restarted from %s at step %d\n", restart_path, first_step);
+    }
+
+    halo_exchange ex;
+    halo_init(&ex, &g, comm_cart, exchange_mode, 0, T_k, T_kn);
+
+    // In overlap mode, time a few exchanges without computation as the reference for
+    // how much communication time a time step can hide
+    double t_exchange_ref = 0.0;
+    if (overlap) {
+        int num_probes = 10;
+        MPI_Barrier(comm_cart);
+        double t0 = MPI_Wtime();
+        for (int p = 0; p < num_probes; p++) {
+            halo_start(&ex, T_k, &g);
+            halo_finish(&ex, T_k, &g);
+        }
+        t_exchange_ref = (MPI_Wtime() - t0) / num_probes;
+    }
+
+    double t_interior = 0.0, t_wait = 0.0, t_boundary = 0.0;
+    int num_exchanges = 0;
+
+    // Level hierarchy of the implicit solvers; the red-black solver only uses the finest level
+    mg_level levels[16];
+    int num_levels = 0;
+    long long solver_iterations = 0;
+    if (solver != SOLVER_EXPLICIT) {
+        num_levels = mg_init(levels, solver == SOLVER_MULTIGRID ? 16 : 1, bs_x, bs_y, x0, y0,
+                             conductivity * delta_t, comm_cart);
+        if (rank == 0 && solver == SOLVER_MULTIGRID) {
+            const mg_level* C = &levels[num_levels - 1];
+            if (C->agglomerate)
+                printf("Multigrid levels: %d distributed, %d on rank 0 after agglomerating a %d x %d grid\n",
+                       num_levels, C->num_serial, C->serial[0].g.nx, C->serial[0].g.ny);
+            else
+                printf("Multigrid levels: %d\n", num_levels);
+            if (num_levels < 2 && !C->agglomerate)
+                fprintf(stderr, "Warning: the blocks are too small to coarsen, the multigrid solver "
+                        "degenerates to red-black smoothing\n");
+        }
+    }
+
+    // In steady-state mode the global residual is reduced with MPI_Iallreduce every check_every
+    // steps. The reduction runs while the next check_every steps are computed and is only
+    // evaluated at the following check, so there is no global synchronization per step.
+    MPI_Request residual_request = MPI_REQUEST_NULL;
+    double residual_local = 0.0, residual_global = 0.0;
+    int residual_step = 0;
+    int converged = 0;
+    phase_end(&timer, PHASE_INIT);
+
+    // Time-stepping loop; with tiling, every exchange is followed by tile_steps time steps
+    int k = first_step;
+    while (k < num_time_steps) {
+        int steps = num_time_steps - k < tile_steps ? num_time_steps - k : tile_steps;
+        if (checkpoint_every > 0 && steps_to_multiple(k, checkpoint_every) < steps)
+            steps = steps_to_multiple(k, checkpoint_every);
+        if (tolerance > 0 && steps_to_multiple(k, check_every) < steps)
+            steps = steps_to_multiple(k, check_every);
+
+        if (solver != SOLVER_EXPLICIT) {
+            // The exchanges of the implicit solvers are part of their iterations, so the whole
+            // solve counts as stencil time
+            phase_begin(&timer, PHASE_STENCIL);
+            solver_iterations += implicit_step(solver, levels, num_levels, T_k, T_kn, &g, omega,
+                                               solver_tol, max_iterations, comm_cart);
+            phase_end(&timer, PHASE_STENCIL);
+        } else {
+            double t0 = MPI_Wtime();
+            phase_begin(&timer, PHASE_EXCHANGE_POST);
+            halo_start(&ex, T_k, &g);
+            phase_end(&timer, PHASE_EXCHANGE_POST);
+
+            double t1 = MPI_Wtime();
+            if (overlap) {
+                phase_begin(&timer, PHASE_STENCIL);
+                if (tile > 0)
+                    compute_tiles(T_k, T_kn, &g, tile, steps, TILES_INTERIOR, scratch_a, scratch_b,
+                                  conductivity, delta_t);
+                else
+                    compute_interior(T_k, T_kn, &g, conductivity, delta_t);
+                phase_end(&timer, PHASE_STENCIL);
+                t_interior += MPI_Wtime() - t1;
             }
+
+            double t2 = MPI_Wtime();
+            phase_begin(&timer, PHASE_EXCHANGE_WAIT);
+            halo_finish(&ex, T_k, &g);
+            phase_end(&timer, PHASE_EXCHANGE_WAIT);
+            double t3 = MPI_Wtime();
+            t_wait += t3 - t2 + (t1 - t0);
+
+            // Compute the heat equation for the local sub-grid
+            phase_begin(&timer, PHASE_STENCIL);
+            if (tile > 0) {
+                compute_tiles(T_k, T_kn, &g, tile, steps, overlap ? TILES_BOUNDARY : TILES_ALL,
+                              scratch_a, scratch_b, conductivity, delta_t);
+            } else {
+                if (!overlap) {
+                    compute_interior(T_k, T_kn, &g, conductivity, delta_t);
+                }
+                compute_boundary(T_k, T_kn, &g, conductivity, delta_t);
+            }
+            phase_end(&timer, PHASE_STENCIL);
+            t_boundary += MPI_Wtime() - t3;
         }
 
         // Swap the grids
         swap(&T_k, &T_kn);
+        k += steps;
+        num_exchanges++;
+
+        if (checkpoint_every > 0 && k % checkpoint_every == 0) {
+            phase_begin(&timer, PHASE_IO);
+            checkpoint_write(checkpoint_path, T_k, &g, grid_size_x, grid_size_y,
+                             x0, y0, k, comm_cart);
+            phase_end(&timer, PHASE_IO);
+        }
+
+        if (tolerance > 0 && k % check_every == 0) {
+            // Evaluate the residual reduced since the previous check, then start the next reduction
+            phase_begin(&timer, PHASE_REDUCE);
+            if (residual_request != MPI_REQUEST_NULL) {
+                MPI_Wait(&residual_request, MPI_STATUS_IGNORE);
+                if (residual_global < tolerance) {
+                    converged = 1;
+                    phase_end(&timer, PHASE_REDUCE);
+                    phase_step_end(&timer);
+                    break;
+                }
+            }
+            residual_local = local_residual(T_k, T_kn, &g, steps);
+            residual_step = k;
+            MPI_Iallreduce(&residual_local, &residual_global, 1, MPI_DOUBLE, MPI_MAX, comm_cart,
+                           &residual_request);
+            phase_end(&timer, PHASE_REDUCE);
+        }
+        phase_step_end(&timer);
+    }
+    if (residual_request != MPI_REQUEST_NULL) {
+        MPI_Wait(&residual_request, MPI_STATUS_IGNORE);
+        converged = converged || residual_global < tolerance;
+    }
+    if (solver != SOLVER_EXPLICIT && rank == 0 && k > first_step) {
+        printf("Solver iterations per time step: %.2f\n", (double)solver_iterations / (k - first_step));
+    }
+    if (tolerance > 0 && rank == 0) {
+        printf("%s after %d steps, residual %e at step %d\n", converged ? "Converged" : "Not converged",
+               k, residual_global, residual_step);
     }
 
-    // Gather the results at the root process
-    double* T_global = NULL;
-    if (rank == 0) {
-        T_global = (double*)malloc(sizeof(double) * grid_size_x * grid_size_y);
+    // Report the exposed and the hidden communication time per exchange (averaged over processes)
+    if (overlap && num_exchanges > 0) {
+        double t_wait_step = t_wait / num_exchanges;
+        double t_hidden_step = t_exchange_ref > t_wait_step ? t_exchange_ref - t_wait_step : 0.0;
+        double local_times[4] = {t_exchange_ref, t_interior / num_exchanges, t_wait_step, t_hidden_step};
+        double sum_times[4];
+        MPI_Reduce(local_times, sum_times, 4, MPI_DOUBLE, MPI_SUM, 0, comm_cart);
+        if (rank == 0) {
+            printf("Per exchange (avg over %d processes): exchange %.3e s, interior %.3e s, "
+                   "exposed wait %.3e s, hidden %.3e s\n", size,
+                   sum_times[0] / size, sum_times[1] / size, sum_times[2] / size, sum_times[3] / size);
+        }
     }
-    MPI_Gather(T_k, bs_x * bs_y, MPI_DOUBLE, T_global, bs_x * bs_y, MPI_DOUBLE, 0, comm_cart);
 
-    // Compute the average temperature
+    // Reduce the diagnostics over all processes; no process holds more than its own block
+    phase_begin(&timer, PHASE_REDUCE);
+    field_stats stats = compute_field_stats(T_k, &g, comm_cart);
+    phase_end(&timer, PHASE_REDUCE);
+    double num_cells = (double)grid_size_x * grid_size_y;
     if (rank == 0) {
-        double T_average = 0.0;
-        for (int i = 0; i < grid_size_x * grid_size_y; i++) {
-            T_average += T_global[i];
-        }
-        T_average /= (grid_size_x * grid_size_y);
-        printf("T_average: %f \n", T_average);
-        free(T_global);
+        printf("T_average: %f \n", stats.sum / num_cells);
+        printf("T_min: %f, T_max: %f, L2 norm: %e\n", stats.min, stats.max, sqrt(stats.sum_sq));
+    }
+
+    // Every process writes its own block of the final field into the shared output file
+    if (output_path != NULL) {
+        phase_begin(&timer, PHASE_IO);
+        checkpoint_write(output_path, T_k, &g, grid_size_x, grid_size_y,
+                         x0, y0, k, comm_cart);
+        phase_end(&timer, PHASE_IO);
     }
+    phase_report(&timer, "heat2d", timing_path, comm_cart);
 
     // Free allocated memory
     free(T_k);
     free(T_kn);
+    for (int t = 0; t < num_threads; t++) {
+        free(scratch_a[t]);
+        free(scratch_b[t]);
+    }
+    free(scratch_a);
+    free(scratch_b);
+    halo_free(&ex);
+    mg_free(levels, num_levels);
 
+    MPI_Comm_free(&comm_cart);
     MPI_Finalize();
     return 0;
 }
-